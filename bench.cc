@@ -0,0 +1,329 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright(c) Leonardo Romor <leonardo.romor@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+//
+// Renders reproducible scenes offscreen and reports the timings as
+// JSON so that runs can be compared.
+#include <getopt.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <vulkan/vulkan.hpp>
+
+#include "camera.h"
+#include "cli-util.h"
+#include "curve.h"
+#include "profiler.h"
+#include "reference-grid.h"
+#include "scene.h"
+#include "vulkan-core.h"
+
+namespace {
+  struct Scenario {
+    unsigned curves = 16;
+    unsigned control_points = 16;
+    unsigned degree = 3;
+    unsigned steps = 1000;
+    uint64_t frames = 1000;
+    uint64_t warmup = 100;
+    vk::Extent2D extent = vk::Extent2D(1024, 768);
+  };
+
+  // Deterministic control points, curve i is a helix turned by i.
+  std::vector<Point> ControlPoints(unsigned curve, unsigned count) {
+    std::vector<Point> points;
+    for (unsigned j = 0; j < count; ++j) {
+      const float angle = 0.7f * j + curve;
+      const float radius = 2.0f + 0.25f * curve;
+      points.push_back({ radius * std::cos(angle), 0.2f * j, radius * std::sin(angle) });
+    }
+    return points;
+  }
+
+  void PrintSummary(FILE *out, const Profiler::Summary &s) {
+    fprintf(out, "{ \"count\": %zu, \"mean\": %.4f, \"p50\": %.4f, \"p95\": %.4f, "
+            "\"p99\": %.4f, \"max\": %.4f }", s.count, s.mean, s.p50, s.p95, s.p99, s.max);
+  }
+
+  // Allocations made with operator new by any thread.
+  std::atomic<uint64_t> heap_allocations(0);
+}
+
+// Count the allocations so that the frame submission
+// can be checked not to allocate in the steady state.
+void *operator new(size_t size) {
+  heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+static int usage(const char *prog, const char *msg) {
+  if (msg) {
+    fprintf(stderr, "\033[1m\033[31m%s\033[0m\n\n", msg);
+  }
+  fprintf(stderr, "Usage: %s [options]\n"
+          "Options:\n", prog);
+  fprintf(stderr,
+          "\t    --curves <n>         : Number of curves (default 16).\n"
+          "\t    --control-points <n> : Control points per curve (default 16).\n"
+          "\t    --steps <n>          : Samples per curve (default 1000).\n"
+          "\t    --frames <n>         : Frames measured (default 1000).\n"
+          "\t    --warmup <n>         : Frames rendered before measuring (default 100).\n"
+          "\t    --size <w>x<h>       : Image size (default 1024x768).\n"
+          "\t    --frames-in-flight <n> : Frames prepared ahead of the GPU (default 2).\n"
+          "\t    --record-threads <n> : Threads recording the draw commands.\n"
+          "\t    --msaa <samples>     : Samples per pixel (default 4). The automatic\n"
+          "\t                           sampling is not used, runs must be comparable.\n"
+          "\t    --output <file>      : Write the JSON report to <file> instead of stdout.\n"
+          "\t-h, --help               : Display this help text and exit.\n");
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  Scenario scenario;
+  SceneConfig scene_config;
+  scene_config.samples = 4;
+  std::string output_path;
+
+  enum LongOptionsOnly {
+    OPT_CURVES = 1000,
+    OPT_CONTROL_POINTS,
+    OPT_STEPS,
+    OPT_FRAMES,
+    OPT_WARMUP,
+    OPT_SIZE,
+    OPT_FRAMES_IN_FLIGHT,
+    OPT_RECORD_THREADS,
+    OPT_MSAA,
+    OPT_OUTPUT,
+  };
+
+  static struct option long_options[] = {
+    { "help",           no_argument,       NULL, 'h' },
+    { "curves",         required_argument, NULL, OPT_CURVES },
+    { "control-points", required_argument, NULL, OPT_CONTROL_POINTS },
+    { "steps",          required_argument, NULL, OPT_STEPS },
+    { "frames",         required_argument, NULL, OPT_FRAMES },
+    { "warmup",         required_argument, NULL, OPT_WARMUP },
+    { "size",           required_argument, NULL, OPT_SIZE },
+    { "frames-in-flight", required_argument, NULL, OPT_FRAMES_IN_FLIGHT },
+    { "record-threads", required_argument, NULL, OPT_RECORD_THREADS },
+    { "msaa",           required_argument, NULL, OPT_MSAA },
+    { "output",         required_argument, NULL, OPT_OUTPUT },
+    { 0,                0,                 0,    0  },
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'h':
+      return usage(argv[0], NULL);
+    case OPT_CURVES:
+      if (auto curves = ParseUnsigned(optarg, 0, 65535))
+        scenario.curves = *curves;
+      else
+        return usage(argv[0], "Invalid number of curves.");
+      break;
+    case OPT_CONTROL_POINTS:
+      if (auto points = ParseUnsigned(optarg, scenario.degree + 1, 65535))
+        scenario.control_points = *points;
+      else
+        return usage(argv[0], "Invalid number of control points, a cubic curve needs 4 to 65535.");
+      break;
+    case OPT_STEPS:
+      scenario.steps = atoi(optarg);
+      if (scenario.steps < 1 || scenario.steps >= 65535)
+        return usage(argv[0], "Steps must be between 1 and 65534.");
+      break;
+    case OPT_FRAMES:
+      scenario.frames = strtoull(optarg, NULL, 10);
+      if (scenario.frames == 0)
+        return usage(argv[0], "Invalid number of frames.");
+      break;
+    case OPT_WARMUP:
+      scenario.warmup = strtoull(optarg, NULL, 10);
+      break;
+    case OPT_SIZE:
+      if (sscanf(optarg, "%ux%u", &scenario.extent.width, &scenario.extent.height) != 2
+          || scenario.extent.width == 0 || scenario.extent.height == 0)
+        return usage(argv[0], "Invalid size, expected <width>x<height>.");
+      break;
+    case OPT_FRAMES_IN_FLIGHT:
+      if (auto frames = ParseUnsigned(optarg, 1, 3))
+        scene_config.frames_in_flight = *frames;
+      else
+        return usage(argv[0], "Frames in flight must be between 1 and 3.");
+      break;
+    case OPT_RECORD_THREADS:
+      if (auto threads = ParseUnsigned(optarg, 1, MaxRecordThreads()))
+        scene_config.record_threads = *threads;
+      else
+        return usage(argv[0], "Invalid number of record threads.");
+      break;
+    case OPT_MSAA:
+      if (auto samples = ParseSampleCount(optarg))
+        scene_config.samples = *samples;
+      else
+        return usage(argv[0], "Invalid number of samples, expected a power of two.");
+      break;
+    case OPT_OUTPUT:
+      output_path = optarg;
+      break;
+    default:
+      return usage(argv[0], "Unkown or invalid option.");
+    }
+  }
+
+  const struct space::core::VkAppConfig config = {
+    "SpaceBench", "SpaceEngine", {}, {}};
+
+  space::core::VkAppContext vk_ctx;
+  if (auto ret = space::core::InitVulkan(config)) {
+    vk_ctx = std::move(ret.value());
+  } else {
+    fprintf(stderr, "Couldn't initialize vulkan.");
+    return 1;
+  }
+
+  FILE *out = stdout;
+  int status = 0;
+  if (!output_path.empty()) {
+    out = fopen(output_path.c_str(), "w");
+    if (!out) {
+      perror(output_path.c_str());
+      return 1;
+    }
+  }
+
+  {
+    Camera camera;
+    Profiler profiler(scenario.frames);
+    const int frame_series = profiler.Series("frame");
+    scene_config.profiler = &profiler;
+    const vk::Extent2D extent = scenario.extent;
+    Scene scene(&vk_ctx, &camera, [extent]() { return extent; }, scene_config);
+
+    ReferenceGrid reference_grid;
+    std::vector<std::unique_ptr<Curve>> curves;
+    for (unsigned i = 0; i < scenario.curves; ++i) {
+      curves.push_back(
+        std::make_unique<Curve>(
+          ControlPoints(i, scenario.control_points), scenario.degree, scenario.steps));
+    }
+
+    scene.Init();
+    scene.AddEntity(&reference_grid);
+    for (const auto &curve : curves)
+      scene.AddEntity(curve.get());
+    vk_ctx.pipeline_compiler->WaitIdle();
+
+    // The camera orbits around the center by the same angle
+    // each frame, every run renders the same images.
+    uint64_t heap_allocation_regressions = 0;
+    auto render_frame = [&]() {
+      camera.TrackballControlRotate(0.01f, 0.0f);
+      // Once in steady state, submitting must not allocate.
+      const bool steady = scene.steady_state();
+      const uint64_t allocations = heap_allocations.load(std::memory_order_relaxed);
+      scene.SubmitRendering();
+      const uint64_t allocated = heap_allocations.load(std::memory_order_relaxed) - allocations;
+      if (steady && allocated) {
+        if (!heap_allocation_regressions) {
+          fprintf(stderr, "%llu heap allocations while submitting a frame in steady state.\n",
+                  (unsigned long long) allocated);
+        }
+        heap_allocation_regressions++;
+      }
+      scene.Present();
+    };
+
+    for (uint64_t i = 0; i < scenario.warmup; ++i)
+      render_frame();
+    vk_ctx.device->waitIdle();
+    profiler.Reset();
+
+    const auto start = Profiler::Clock::now();
+    auto frame_start = start;
+    for (uint64_t i = 0; i < scenario.frames; ++i) {
+      render_frame();
+      const auto frame_end = Profiler::Clock::now();
+      profiler.Record(
+        frame_series, frame_start,
+        std::chrono::duration<double, std::milli>(frame_end - frame_start).count());
+      frame_start = frame_end;
+    }
+    vk_ctx.device->waitIdle();
+    const double elapsed = std::chrono::duration<double>(Profiler::Clock::now() - start).count();
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    const auto memory_stats = space::core::GetMemoryStats(vk_ctx);
+    const auto device_properties = vk_ctx.physical_device.getProperties();
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"device\": \"%s\",\n", &device_properties.deviceName[0]);
+    fprintf(out, "  \"scenario\": { \"curves\": %u, \"control_points\": %u, \"degree\": %u, "
+            "\"steps\": %u, \"frames\": %llu, \"warmup\": %llu, \"width\": %u, \"height\": %u, "
+            "\"samples\": %u, \"frames_in_flight\": %u },\n",
+            scenario.curves, scenario.control_points, scenario.degree, scenario.steps,
+            (unsigned long long) scenario.frames, (unsigned long long) scenario.warmup,
+            extent.width, extent.height, static_cast<unsigned>(scene.sample_count()),
+            scene_config.frames_in_flight);
+    fprintf(out, "  \"elapsed_s\": %.4f,\n", elapsed);
+    fprintf(out, "  \"fps\": %.2f,\n", scenario.frames / elapsed);
+
+    // The frame series first, then the CPU phases and the GPU passes.
+    const auto summaries = profiler.Summarize();
+    fprintf(out, "  \"frame_time_ms\": ");
+    PrintSummary(out, summaries[frame_series]);
+    fprintf(out, ",\n  \"phases_ms\": {");
+    bool first = true;
+    for (size_t i = 0; i < summaries.size(); ++i) {
+      if (static_cast<int>(i) == frame_series) continue;
+      fprintf(out, "%s\n    \"%s\": ", first ? "" : ",", summaries[i].name.c_str());
+      PrintSummary(out, summaries[i]);
+      first = false;
+    }
+    fprintf(out, "\n  },\n");
+    // ru_maxrss is in KiB on linux.
+    fprintf(out, "  \"peak_rss_bytes\": %llu,\n", (unsigned long long) usage.ru_maxrss * 1024);
+    fprintf(out, "  \"peak_device_memory_bytes\": %llu,\n",
+            (unsigned long long) memory_stats.peak_allocated);
+    fprintf(out, "  \"sync_object_regressions\": %llu,\n",
+            (unsigned long long) scene.sync_object_regressions());
+    fprintf(out, "  \"heap_allocation_regressions\": %llu\n",
+            (unsigned long long) heap_allocation_regressions);
+    fprintf(out, "}\n");
+    // Synchronization objects and memory must be recycled,
+    // fail the run otherwise.
+    status = scene.sync_object_regressions() || heap_allocation_regressions ? 1 : 0;
+  }
+
+  if (out != stdout)
+    fclose(out);
+  return status;
+}
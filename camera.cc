@@ -12,6 +12,7 @@
 // dx: left and right.
 // dy: forward and backward.
 void Camera::FirstPersonControlMove(float dx, float dy) {
+  version_++;
   const glm::vec3 eyecenter = camera_vectors_.eye - camera_vectors_.center;
   const glm::vec3 neye = glm::normalize(eyecenter);
   const glm::vec3 nup = glm::normalize(camera_vectors_.up);
@@ -28,6 +29,7 @@ void Camera::FirstPersonControlMove(float dx, float dy) {
 void Camera::FirstPersonControlCenter(float dtheta, float dphy) {
   float angle = sqrt(dtheta * dtheta + dphy * dphy);
   if (std::fabs(angle) < 1e-3) return;
+  version_++;
   const glm::vec3 eyecenter = camera_vectors_.center - camera_vectors_.eye;
   const glm::vec3 neye = glm::normalize(eyecenter);
   const glm::vec3 nup = glm::normalize(camera_vectors_.up);
@@ -50,6 +52,7 @@ void Camera::FirstPersonControlCenter(float dtheta, float dphy) {
 // When doing left/right the camera rotates around ths eye-center axis.
 // When doing up/down it rotates around the side axis.
 void Camera::FirstPersonControlRotate(float dtheta, float dphy) {
+  version_++;
   dtheta /= 10;
   dphy /= 10;
   const glm::vec3 eyecenter = - camera_vectors_.eye + camera_vectors_.center;
@@ -68,6 +71,7 @@ void Camera::FirstPersonControlRotate(float dtheta, float dphy) {
 }
 
 void Camera::TrackballControlRotate(float dside, float dup) {
+  version_++;
   const glm::vec3 eyecenter = camera_vectors_.eye - camera_vectors_.center;
   const glm::vec3 neye = glm::normalize(eyecenter);
   const glm::vec3 nup = glm::normalize(camera_vectors_.up);
@@ -89,6 +93,7 @@ void Camera::TrackballControlRotate(float dside, float dup) {
 }
 
 void Camera::TrackballControlPan(float dside, float dup) {
+  version_++;
   const glm::vec3 eyecenter = camera_vectors_.eye - camera_vectors_.center;
   const glm::vec3 neye = glm::normalize(eyecenter);
   const glm::vec3 nup = glm::normalize(camera_vectors_.up);
@@ -100,6 +105,7 @@ void Camera::TrackballControlPan(float dside, float dup) {
 }
 
 void Camera::TrackballControlZoom(float zoom) {
+  version_++;
   const glm::vec3 eyecenter = camera_vectors_.eye - camera_vectors_.center;
   const glm::vec3 neye = glm::normalize(eyecenter);
   const float length = glm::l2Norm(eyecenter);
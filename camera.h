@@ -3,13 +3,14 @@
 #define __CAMERA_H_
 
 #define GLM_ENABLE_EXPERIMENTAL
+#include <cstdint>
 #include <glm/glm.hpp>
 
 class Camera {
 public:
   Camera()
     : camera_vectors_{glm::vec3(0.0f, 2.0f, 10.0f),
-    glm::vec3(0.0f, 2.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f)} {}
+    glm::vec3(0.0f, 2.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f)}, version_(0) {}
 
   void FirstPersonControlMove(float dx, float dy);
   void FirstPersonControlCenter(float dx, float dy);
@@ -22,6 +23,7 @@ public:
 
   struct ProjectionMatrices {
     float fov;
+    // Identity, the entities push their own model matrix.
     glm::mat4x4 model;
     glm::mat4x4 view;
     glm::mat4x4 projection;
@@ -30,6 +32,9 @@ public:
 
   ProjectionMatrices GetProjectionMatrices(float aspect_ratio, float fov = glm::radians(60.0f));
 
+  // Incremented every time the camera moves.
+  uint64_t version() const { return version_; }
+
 private:
 
   struct CameraVectors {
@@ -38,6 +43,7 @@ private:
     glm::vec3 up; // Camera pointing-top vector.
   };
   struct CameraVectors camera_vectors_;
+  uint64_t version_;
 };
 
 #endif // __CAMERA_H_
@@ -0,0 +1,41 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright(c) Leonardo Romor <leonardo.romor@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+#include "cli-util.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <thread>
+
+std::optional<unsigned> ParseUnsigned(const char *text, unsigned min, unsigned max) {
+  char *end;
+  errno = 0;
+  const long value = strtol(text, &end, 10);
+  if (errno || end == text || *end != '\0' || value < long(min) || value > long(max))
+    return {};
+  return value;
+}
+
+std::optional<unsigned> ParseSampleCount(const char *text) {
+  const auto samples = ParseUnsigned(text, 1, 64);
+  if (!samples || (*samples & (*samples - 1)))
+    return {};
+  return samples;
+}
+
+unsigned MaxRecordThreads() {
+  return std::max(1u, std::thread::hardware_concurrency());
+}
@@ -0,0 +1,32 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright(c) Leonardo Romor <leonardo.romor@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+#ifndef __CLI_UTIL_H_
+#define __CLI_UTIL_H_
+
+#include <optional>
+
+// Command line helpers shared by space and space-bench.
+
+// The number in text if it is within [min, max], nothing
+// if it is malformed or out of range.
+std::optional<unsigned> ParseUnsigned(const char *text, unsigned min, unsigned max);
+
+// A sample count, a power of two in [1, 64].
+std::optional<unsigned> ParseSampleCount(const char *text);
+
+// Recording threads beyond the hardware ones don't help.
+unsigned MaxRecordThreads();
+
+#endif // __CLI_UTIL_H_
@@ -39,24 +39,6 @@ Point operator+ (const Point& p1, const Point& p2) {
 }
 
 
-// https://pages.mtu.edu/~shene/COURSES/cs3621/NOTES/spline/B-spline/de-Boor.html
-// Define a parametric NURB in the 3d space with pinned
-// uniform knots
-class NURBS {
-public:
-  typedef std::vector<Point> ControlPoints;
-  NURBS(const ControlPoints &control_points, unsigned int p = 2);
-
-  const Point operator()(float t) const;
-
-private:
-  const ControlPoints cps_;
-  const unsigned int p_;
-  std::vector<float> knots_;
-
-};
-
-
 Point DeBoor(const float t, const std::vector<Point> &points, const std::vector<float> &knots, const unsigned p) {
   assert(points.size() > 0);
   if (points.size() == 1) {
@@ -140,8 +122,48 @@ const Point NURBS::operator()(float t) const {
   return DeBoor(t, points, knots, p_);
 }
 
+Curve::Curve()
+  : Curve({ { 4.0f, 1.0f, 8.3f },
+            { 1.0f, 1.0f, 0.0f },
+            { -3.0f, 1.0f, -2.1f },
+            { 2.0f, 1.0f, 0.0f },
+            { 4.0f, 1.0f, 5.0f },
+            { 3.2f, -1.0f, 0.0f },
+            { 6.0f, 1.0f, 0.3f } }) {}
+
+Curve::Curve(const std::vector<Point> &control_points, unsigned degree, unsigned steps,
+             const Color &color)
+  : control_points_(control_points), degree_(degree), steps_(steps), color_(color) {
+  assert(control_points_.size() > degree_);
+  // Indexed with 16 bits.
+  assert(steps_ < 65535);
+}
+
+std::vector<Point> SampleCurve(const NURBS &f, unsigned steps) {
+  std::vector<Point> points;
+  points.reserve(steps + 1);
+  for (unsigned i = 0; i <= steps; ++i) {
+    const float t = 1.0f * i / steps;
+    points.push_back(f(t));
+  }
+  return points;
+}
+
+std::vector<uint16_t> LineListIndices(size_t count) {
+  std::vector<uint16_t> indexes((count - 1) * 2);
+  for (size_t i = 0; i < indexes.size(); ++i) {
+    indexes[i] = i / 2 + i % 2;
+  }
+  return indexes;
+}
+
 void Curve::Update(const float t) {}
 
+void Curve::SetTransform(const glm::mat4 &model) {
+  draw_constants_.model = model;
+  MarkDirty();
+}
+
 void Curve::Register(
     space::core::VkAppContext *context,
     vk::UniquePipelineLayout *pipeline_layout,
@@ -149,85 +171,72 @@ void Curve::Register(
     vk::SampleCountFlagBits nsamples,
     vk::UniquePipelineCache *pipeline_cache) {
 
-  points_.clear();
+  pipeline_layout_ = pipeline_layout->get();
 
   // Instantiate the shaders
-  vk::UniqueShaderModule vertex =
-    context->device->createShaderModuleUnique(
-      vk::ShaderModuleCreateInfo(
-        vk::ShaderModuleCreateFlags(), sizeof(curve_vert), curve_vert));
-
-  vk::UniqueShaderModule frag =
-    context->device->createShaderModuleUnique(
-      vk::ShaderModuleCreateInfo(
-        vk::ShaderModuleCreateFlags(), sizeof(curve_frag), curve_frag));
+  if (!vertex_shader_) {
+    vertex_shader_ = context->shader_library->Get(context->device, curve_vert);
+    fragment_shader_ = context->shader_library->Get(context->device, curve_frag);
+  }
 
+  const vk::ShaderStageFlagBits fragment = vk::ShaderStageFlagBits::eFragment;
   pipeline_ = space::core::GraphicsPipelineBuilder(
     &context->device, pipeline_layout, render_pass, nsamples)
     .DepthBuffered(true)
     .SetPrimitiveTopology(vk::PrimitiveTopology::eLineList)
     .SetPolygoneMode(vk::PolygonMode::eLine)
-    .AddVertexShader(*vertex)
-    .AddFragmentShader(*frag)
+    .AddVertexShader(vertex_shader_)
+    .AddFragmentShader(fragment_shader_)
+    .AddSpecializationConstant(fragment, 0, color_.r)
+    .AddSpecializationConstant(fragment, 1, color_.g)
+    .AddSpecializationConstant(fragment, 2, color_.b)
+    .AddSpecializationConstant(fragment, 3, color_.a)
     .AddVertexInputBindingDescription(0, sizeof(Point), vk::VertexInputRate::eVertex)
     .AddVertexInputAttributeDescription(0, 0, vk::Format::eR32G32B32Sfloat, 0)
     .EnableDynamicState(vk::DynamicState::eScissor)
     .EnableDynamicState(vk::DynamicState::eViewport)
     .EnableDynamicState(vk::DynamicState::eLineWidth)
-    .Create(pipeline_cache);
-
-  unsigned nsteps = 1000;
-
-  std::vector<Point> points;
-  points.push_back({ 4.0f, 1.0f, 8.3f });
-  points.push_back({ 1.0f, 1.0f, 0.0f });
-  points.push_back({ -3.0f, 1.0f, -2.1f });
-  points.push_back({ 2.0f, 1.0f, 0.0f });
-  points.push_back({ 4.0f, 1.0f, 5.0f });
-  points.push_back({ 3.2f, -1.0f, 0.0f });
-  points.push_back({ 6.0f, 1.0f, 0.3f });
-  auto f = NURBS(points, 3);
-
-  // Sample!
-  for (unsigned i = 0; i <= nsteps; ++i) {
-    const float t = 1.0f * i / nsteps;
-    const Point p = f(t);
-    points_.push_back(p);
+    .CreateAsync(context->pipeline_compiler.get(), pipeline_cache);
+
+  if (!vertices_) {
+    vertices_ = std::make_unique<space::core::DeviceVector<Point>>(
+      context->physical_device, context->device, vk::BufferUsageFlagBits::eVertexBuffer,
+      steps_ + 1, "curve-vertices");
+    vertices_->append(SampleCurve(NURBS(control_points_, degree_), steps_));
+    indices_ = std::make_unique<space::core::DeviceVector<uint16_t>>(
+      context->physical_device, context->device, vk::BufferUsageFlagBits::eIndexBuffer,
+      2 * steps_, "curve-indices");
+    indices_->append(LineListIndices(vertices_->size()));
   }
+}
 
-  vertex_buffer_data_ = std::make_unique<space::core::BufferData>(
-    context->physical_device, context->device, points_.size() * sizeof(Point),
-    vk::BufferUsageFlagBits::eVertexBuffer);
-  // Submit them to the device
-  space::core::CopyToDevice(
-    context->device, vertex_buffer_data_->deviceMemory, points_.data(), points_.size());
-
-  // Build the index buffer
-  std::vector<uint16_t> indexes((points_.size() - 1) * 2);
-  for (size_t i = 0; i < indexes.size(); ++i) {
-    indexes[i] = i / 2 + i % 2;
-  }
-  index_buffer_data_ = std::make_unique<space::core::BufferData>(
-    space::core::BufferData(
-      context->physical_device, context->device, indexes.size() * sizeof(uint16_t),
-      vk::BufferUsageFlagBits::eIndexBuffer));
-
-  // Submit them to the device
-  space::core::CopyToDevice(
-    context->device, index_buffer_data_->deviceMemory, indexes.data(), indexes.size());
+bool Curve::Upload(vk::CommandBuffer command_buffer, uint64_t serial,
+                   uint64_t completed_serial) {
+  vertices_->ReleaseRetired(completed_serial);
+  indices_->ReleaseRetired(completed_serial);
+  if (!vertices_->dirty() && !indices_->dirty())
+    return false;
+  vertices_->Flush(command_buffer, serial);
+  indices_->Flush(command_buffer, serial);
+  // The buffers might have been replaced.
+  MarkDirty();
+  return true;
 }
 
 void Curve::Draw(const vk::UniqueCommandBuffer *command_buffer) {
   const vk::UniqueCommandBuffer &cb  = *command_buffer;
+  // The compilation failed, or nothing is uploaded yet.
+  if (!pipeline_.get() || !vertices_->buffer()) return;
 
   // Tell vulkan the next commands are associated to this pipeline.
   cb->bindPipeline(
     vk::PipelineBindPoint::eGraphics, pipeline_.get());
 
   // Tell vulkan which buffer contains the vertices we want to draw.
-  cb->bindVertexBuffers(0, *vertex_buffer_data_->buffer, {0});
-  cb->bindIndexBuffer(*index_buffer_data_->buffer, 0, vk::IndexType::eUint16);
+  cb->bindVertexBuffers(0, vertices_->buffer(), {0});
+  cb->bindIndexBuffer(indices_->buffer(), 0, vk::IndexType::eUint16);
+  PushDrawConstants(command_buffer, pipeline_layout_, draw_constants_);
   cb->setLineWidth(2.0);
 
-  cb->drawIndexed((points_.size() - 1) * 2, 1, 0, 0, 0);
+  cb->drawIndexed(indices_->size(), 1, 0, 0, 0);
 }
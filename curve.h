@@ -16,8 +16,11 @@
 #define __CURVE_H_
 
 #include <vulkan/vulkan.hpp>
+#include <cstdint>
 #include <sstream>
+#include <vector>
 
+#include "device-vector.h"
 #include "vulkan-core.h"
 #include "entity.h"
 
@@ -37,9 +40,47 @@ Point operator* (const float scalar, const Point& point);
 Point operator* (const Point& point, const float scalar);
 Point operator+ (const Point& p1, const Point& p2);
 
+// https://pages.mtu.edu/~shene/COURSES/cs3621/NOTES/spline/B-spline/de-Boor.html
+// Define a parametric NURB in the 3d space with pinned
+// uniform knots
+class NURBS {
+public:
+  typedef std::vector<Point> ControlPoints;
+  NURBS(const ControlPoints &control_points, unsigned int p = 2);
+
+  const Point operator()(float t) const;
+
+private:
+  const ControlPoints cps_;
+  const unsigned int p_;
+  std::vector<float> knots_;
+
+};
+
+// Evaluate at t the curve of degree p defined by the points
+// and the knots of their basis functions.
+Point DeBoor(const float t, const std::vector<Point> &points,
+             const std::vector<float> &knots, const unsigned p);
+
+// Evaluate f at steps + 1 evenly spaced values of t in [0, 1].
+std::vector<Point> SampleCurve(const NURBS &f, unsigned steps);
+
+// Indices drawing count points as a line list of consecutive segments.
+std::vector<uint16_t> LineListIndices(size_t count);
+
+struct Color {
+  float r, g, b, a;
+};
+
 class Curve : public space::Entity {
 public:
-  Curve() {}
+  // A default curve, for demo purposes.
+  Curve();
+  // A NURBS curve of the given degree defined by the control
+  // points, sampled at steps + 1 points. Curves of different
+  // colors don't share their pipeline.
+  Curve(const std::vector<Point> &control_points, unsigned degree = 3,
+        unsigned steps = 1000, const Color &color = { 0.0f, 0.0f, 0.0f, 1.0f });
   virtual void Register(
     space::core::VkAppContext *context,
     vk::UniquePipelineLayout *pipeline_layout,
@@ -51,17 +92,34 @@ public:
   // Draw in the command buffer
   virtual void Draw(const vk::UniqueCommandBuffer *command_buffer) final;
 
+  virtual bool Upload(vk::CommandBuffer command_buffer, uint64_t serial,
+                      uint64_t completed_serial) final;
+
+  virtual bool Ready() const final { return pipeline_.ready(); }
+  virtual const void *PipelineId() const final { return pipeline_.id(); }
+
   // Update the curve to render from 0 up to t.
   void Update(const float t);
 
+  // Place the curve in the scene, identity by default.
+  void SetTransform(const glm::mat4 &model);
+
 private:
-  vk::UniquePipeline pipeline_;
-  std::vector<Point> points_;
+  space::core::PipelineCompiler::Future pipeline_;
+  // Shared with the other curves, kept across registrations.
+  space::core::ShaderLibrary::Handle vertex_shader_;
+  space::core::ShaderLibrary::Handle fragment_shader_;
+  const std::vector<Point> control_points_;
+  const unsigned degree_;
+  const unsigned steps_;
+  const Color color_;
 
-  space::core::VkAppContext *vk_ctx_;
+  vk::PipelineLayout pipeline_layout_;
+  space::DrawConstants draw_constants_;
 
-  std::unique_ptr<space::core::BufferData> vertex_buffer_data_;
-  std::unique_ptr<space::core::BufferData> index_buffer_data_;
+  // Sampled once, uploaded by the first Upload().
+  std::unique_ptr<space::core::DeviceVector<Point>> vertices_;
+  std::unique_ptr<space::core::DeviceVector<uint16_t>> indices_;
 };
 
 #endif // __CURVE_H_
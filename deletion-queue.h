@@ -0,0 +1,65 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright(c) Leonardo Romor <leonardo.romor@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+#ifndef __DELETION_QUEUE_H_
+#define __DELETION_QUEUE_H_
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+namespace space {
+  namespace core {
+    // Keeps resources the GPU might still be using alive until the
+    // submission identified by a serial has completed, so that they
+    // can be replaced without waiting for the device to be idle.
+    // Serials are expected to be increasing.
+    class DeletionQueue {
+    public:
+      // Take ownership of object (e.g. a vk::Unique* handle or a
+      // std::unique_ptr) until Collect() is called with serial.
+      template <typename T>
+      void Retire(uint64_t serial, T &&object) {
+        static_assert(!std::is_lvalue_reference<T>::value, "Retire() takes ownership.");
+        retired_.push_back({serial, std::make_unique<Holder<T>>(std::move(object))});
+      }
+
+      // Destroy everything retired up to completed_serial.
+      void Collect(uint64_t completed_serial) {
+        while (!retired_.empty() && retired_.front().first <= completed_serial)
+          retired_.pop_front();
+      }
+
+      size_t size() const { return retired_.size(); }
+      bool empty() const { return retired_.empty(); }
+
+    private:
+      struct Retired {
+        virtual ~Retired() {}
+      };
+
+      template <typename T>
+      struct Holder : public Retired {
+        explicit Holder(T &&object) : object(std::move(object)) {}
+        T object;
+      };
+
+      std::deque<std::pair<uint64_t, std::unique_ptr<Retired>>> retired_;
+    };
+  }
+}
+
+#endif // __DELETION_QUEUE_H_
@@ -0,0 +1,272 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright(c) Leonardo Romor <leonardo.romor@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+#ifndef __DEVICE_VECTOR_H_
+#define __DEVICE_VECTOR_H_
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <vulkan/vulkan.hpp>
+
+#include "deletion-queue.h"
+#include "vulkan-core.h"
+
+namespace space {
+  namespace core {
+    // Host visible ring buffer used to stage uploads. Every allocation
+    // is tagged with the serial of the submission reading it and the
+    // space is given back once that serial is known to be completed.
+    class StagingRing {
+    public:
+      StagingRing(vk::PhysicalDevice const& physical_device,
+                  vk::UniqueDevice const& device, vk::DeviceSize size)
+        : buffer_(std::make_unique<BufferData>(
+                    physical_device, device, size, vk::BufferUsageFlagBits::eTransferSrc,
+                    vk::MemoryPropertyFlagBits::eHostVisible
+                    | vk::MemoryPropertyFlagBits::eHostCoherent, "staging")),
+          mapping_(static_cast<uint8_t*>(
+                     device->mapMemory(*buffer_->deviceMemory, 0, VK_WHOLE_SIZE))),
+          size_(size), head_(0), tail_(0) {}
+
+      // Returns the offset of a free region of the given size or
+      // an empty optional if the ring is full.
+      std::optional<vk::DeviceSize> Allocate(vk::DeviceSize size, uint64_t serial) {
+        if (in_flight_.empty()) head_ = tail_ = 0;
+        vk::DeviceSize offset;
+        if (head_ >= tail_) {
+          if (size_ - head_ >= size) {
+            offset = head_;
+          } else if (tail_ > size) {
+            // Wrap around, the end of the ring is left unused.
+            offset = 0;
+          } else {
+            return {};
+          }
+        } else if (tail_ - head_ > size) {
+          offset = head_;
+        } else {
+          return {};
+        }
+        head_ = offset + size;
+        in_flight_.push_back({serial, head_});
+        return offset;
+      }
+
+      void Release(uint64_t completed_serial) {
+        while (!in_flight_.empty() && in_flight_.front().first <= completed_serial) {
+          tail_ = in_flight_.front().second;
+          in_flight_.pop_front();
+        }
+      }
+
+      vk::Buffer buffer() const { return *buffer_->buffer; }
+      uint8_t *mapping() const { return mapping_; }
+      vk::DeviceSize size() const { return size_; }
+
+    private:
+      std::unique_ptr<BufferData> buffer_;
+      uint8_t *mapping_;
+      vk::DeviceSize size_;
+      vk::DeviceSize head_;
+      vk::DeviceSize tail_;
+      // Serial and end offset of each allocation still in use.
+      std::deque<std::pair<uint64_t, vk::DeviceSize>> in_flight_;
+    };
+
+    // A growable array of T stored in device local memory.
+    // Elements are written to a host copy, Flush() then records the
+    // commands uploading only the modified range. Growing the capacity
+    // copies the old content on the GPU, the old buffer is kept alive
+    // until the submission using it has completed.
+    template <typename T>
+    class DeviceVector {
+      static_assert(std::is_trivially_copyable<T>::value,
+                    "DeviceVector elements are copied with memcpy.");
+    public:
+      DeviceVector(vk::PhysicalDevice const& physical_device,
+                   vk::UniqueDevice const& device,
+                   vk::BufferUsageFlags usage, size_t capacity = 0,
+                   const char *tag = "device-vector")
+        : physical_device_(physical_device), device_(&device),
+          usage_(usage | vk::BufferUsageFlagBits::eTransferDst
+                 | vk::BufferUsageFlagBits::eTransferSrc),
+          tag_(tag), capacity_(0), device_capacity_(0), synced_size_(0),
+          dirty_begin_(0), dirty_end_(0) {
+        reserve(capacity);
+      }
+
+      void reserve(size_t capacity) {
+        if (capacity <= capacity_) return;
+        capacity_ = capacity;
+        host_.reserve(capacity_);
+      }
+
+      void push_back(const T &value) { append(&value, 1); }
+
+      void append(const T *data, size_t count) {
+        if (count == 0) return;
+        const size_t size = host_.size();
+        if (size + count > capacity_)
+          reserve(std::max({size + count, 2 * capacity_, kMinCapacity}));
+        host_.insert(host_.end(), data, data + count);
+        MarkDirty(size, size + count);
+      }
+
+      void append(const std::vector<T> &values) { append(values.data(), values.size()); }
+
+      // Modify an existing element.
+      void set(size_t index, const T &value) {
+        assert(index < host_.size());
+        host_[index] = value;
+        MarkDirty(index, index + 1);
+      }
+
+      // Drop the content. The device memory is kept.
+      void clear() {
+        host_.clear();
+        synced_size_ = 0;
+        dirty_begin_ = dirty_end_ = 0;
+      }
+
+      const T &operator[](size_t index) const { return host_[index]; }
+      size_t size() const { return host_.size(); }
+      size_t capacity() const { return capacity_; }
+      bool empty() const { return host_.empty(); }
+      bool dirty() const { return dirty_end_ > dirty_begin_ || device_capacity_ < capacity_; }
+
+      // The device buffer, valid after the first Flush().
+      vk::Buffer buffer() const { return buffer_ ? *buffer_->buffer : vk::Buffer(); }
+
+      // Record the commands bringing the device buffer up to date. Must be
+      // recorded outside of a render pass, e.g. from Entity::Upload().
+      // serial identifies the submission of command_buffer and is used to
+      // know when retired memory can be freed.
+      void Flush(vk::CommandBuffer command_buffer, uint64_t serial) {
+        if (!dirty()) return;
+        const vk::UniqueDevice &device = *device_;
+
+        const bool grow = device_capacity_ < capacity_;
+        if (grow) {
+          auto buffer = std::make_unique<BufferData>(
+            physical_device_, device, capacity_ * sizeof(T), usage_,
+            vk::MemoryPropertyFlagBits::eDeviceLocal, tag_);
+          if (synced_size_ > 0) {
+            command_buffer.copyBuffer(
+              *buffer_->buffer, *buffer->buffer,
+              vk::BufferCopy(0, 0, synced_size_ * sizeof(T)));
+            // The dirty range upload might overlap the copied range.
+            command_buffer.pipelineBarrier(
+              vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eTransfer, {},
+              vk::MemoryBarrier(vk::AccessFlagBits::eTransferWrite,
+                                vk::AccessFlagBits::eTransferWrite), nullptr, nullptr);
+          }
+          if (buffer_) retired_.Retire(serial, std::move(buffer_));
+          buffer_ = std::move(buffer);
+          device_capacity_ = capacity_;
+        }
+
+        if (dirty_end_ > dirty_begin_) {
+          if (!grow) {
+            // The frames submitted before might still read the range
+            // being overwritten in place.
+            command_buffer.pipelineBarrier(
+              vk::PipelineStageFlagBits::eVertexInput | vk::PipelineStageFlagBits::eVertexShader
+              | vk::PipelineStageFlagBits::eFragmentShader,
+              vk::PipelineStageFlagBits::eTransfer, {}, nullptr, nullptr, nullptr);
+          }
+          const vk::DeviceSize bytes = (dirty_end_ - dirty_begin_) * sizeof(T);
+          std::optional<vk::DeviceSize> offset;
+          if (staging_) offset = staging_->Allocate(bytes, serial);
+          if (!offset) {
+            // Full, keep the old ring alive for the uploads still reading it.
+            const vk::DeviceSize old_size = staging_ ? staging_->size() : 0;
+            if (staging_) retired_.Retire(serial, std::move(staging_));
+            staging_ = std::make_unique<StagingRing>(
+              physical_device_, device, std::max(2 * old_size, 2 * bytes));
+            offset = staging_->Allocate(bytes, serial);
+          }
+          memcpy(staging_->mapping() + *offset, &host_[dirty_begin_], bytes);
+          command_buffer.copyBuffer(
+            staging_->buffer(), *buffer_->buffer,
+            vk::BufferCopy(*offset, dirty_begin_ * sizeof(T), bytes));
+        }
+
+        // Also orders the next flush, which might copy from the buffer
+        // when growing or write it again.
+        command_buffer.pipelineBarrier(
+          vk::PipelineStageFlagBits::eTransfer,
+          vk::PipelineStageFlagBits::eVertexInput | vk::PipelineStageFlagBits::eVertexShader
+          | vk::PipelineStageFlagBits::eFragmentShader | vk::PipelineStageFlagBits::eTransfer, {},
+          vk::MemoryBarrier(
+            vk::AccessFlagBits::eTransferWrite,
+            vk::AccessFlagBits::eVertexAttributeRead | vk::AccessFlagBits::eIndexRead
+            | vk::AccessFlagBits::eUniformRead | vk::AccessFlagBits::eShaderRead
+            | vk::AccessFlagBits::eTransferRead | vk::AccessFlagBits::eTransferWrite),
+          nullptr, nullptr);
+
+        synced_size_ = host_.size();
+        dirty_begin_ = dirty_end_ = 0;
+      }
+
+      // Free what was retired by the flushes up to completed_serial.
+      void ReleaseRetired(uint64_t completed_serial) {
+        if (staging_) staging_->Release(completed_serial);
+        retired_.Collect(completed_serial);
+      }
+
+    private:
+      static constexpr size_t kMinCapacity = 64;
+
+      void MarkDirty(size_t begin, size_t end) {
+        if (dirty_end_ == dirty_begin_) {
+          dirty_begin_ = begin;
+          dirty_end_ = end;
+        } else {
+          dirty_begin_ = std::min(dirty_begin_, begin);
+          dirty_end_ = std::max(dirty_end_, end);
+        }
+      }
+
+      vk::PhysicalDevice physical_device_;
+      const vk::UniqueDevice *device_;
+      const vk::BufferUsageFlags usage_;
+      const char *tag_;
+
+      std::vector<T> host_;
+      size_t capacity_;
+
+      std::unique_ptr<BufferData> buffer_;
+      size_t device_capacity_;
+      // Number of elements the device buffer holds.
+      size_t synced_size_;
+      // Range of elements to upload, in elements.
+      size_t dirty_begin_;
+      size_t dirty_end_;
+
+      std::unique_ptr<StagingRing> staging_;
+      // Old buffers and staging rings still read by the GPU.
+      DeletionQueue retired_;
+    };
+  }
+}
+
+#endif // __DEVICE_VECTOR_H_
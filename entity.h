@@ -15,11 +15,26 @@
 #ifndef __ENTITY_H_
 #define __ENTITY_H_
 
+#include <glm/glm.hpp>
 #include <vulkan/vulkan.hpp>
 
 #include "vulkan-core.h"
 
 namespace space {
+  // Pushed before each draw, the push_constant block of the shaders.
+  struct DrawConstants {
+    glm::mat4 model = glm::mat4(1.0f);
+    // Free for the entity's shaders.
+    glm::vec4 params = glm::vec4(0.0f);
+  };
+
+  // Push constant range of the pipeline layout given to the entities.
+  inline vk::PushConstantRange DrawConstantsRange() {
+    return vk::PushConstantRange(
+      vk::ShaderStageFlagBits::eVertex | vk::ShaderStageFlagBits::eFragment,
+      0, sizeof(DrawConstants));
+  }
+
   class Entity {
   public:
     Entity() = default;
@@ -31,8 +46,47 @@ namespace space {
       vk::SampleCountFlagBits nsamples,
       vk::UniquePipelineCache *pipeline_cache) = 0;
 
-    // Draw in the command buffer
+    // Draw in the command buffer. Entities are recorded in parallel,
+    // Draw() must not touch state shared with other entities.
     virtual void Draw(const vk::UniqueCommandBuffer *command_buffer) = 0;
+
+    // Transparent entities blend over the others, they are drawn
+    // after all the opaque ones.
+    virtual bool Transparent() const { return false; }
+
+    // Whether the pipelines compiled in the background are ready.
+    // Entities which aren't are skipped until they are.
+    virtual bool Ready() const { return true; }
+
+    // Record the transfers updating the entity's device data, e.g.
+    // DeviceVector::Flush(). Called every frame before recording the
+    // draws, outside of the render pass. serial identifies the
+    // submission of command_buffer, the GPU is done with all those
+    // up to completed_serial. Returns whether anything was recorded.
+    virtual bool Upload(vk::CommandBuffer command_buffer, uint64_t serial,
+                        uint64_t completed_serial) { return false; }
+
+    // Identifies the pipeline the entity is drawn with, entities
+    // sharing one are executed next to each other.
+    virtual const void *PipelineId() const { return nullptr; }
+
+    // The draw commands are recorded once and replayed every frame.
+    // Call this whenever what Draw() records changes.
+    void MarkDirty() { version_++; }
+    uint64_t version() const { return version_; }
+
+  protected:
+    // Set the draw constants of the next draws, layout is the one
+    // given to Register(). Cheaper than any buffer update, moving an
+    // entity only records its commands again.
+    static void PushDrawConstants(const vk::UniqueCommandBuffer *command_buffer,
+                                  vk::PipelineLayout layout, const DrawConstants &constants) {
+      (*command_buffer)->pushConstants(
+        layout, DrawConstantsRange().stageFlags, 0, sizeof(constants), &constants);
+    }
+
+  private:
+    uint64_t version_ = 0;
   };
 }
 
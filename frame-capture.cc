@@ -0,0 +1,293 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright(c) Leonardo Romor <leonardo.romor@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+#include "frame-capture.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+
+namespace {
+  uint32_t Crc32(uint32_t crc, const uint8_t *data, size_t size) {
+    static const std::vector<uint32_t> table = []() {
+      std::vector<uint32_t> table(256);
+      for (uint32_t n = 0; n < 256; ++n) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; ++k)
+          c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        table[n] = c;
+      }
+      return table;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i)
+      crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+  }
+
+  uint32_t Adler32(uint32_t adler, const uint8_t *data, size_t size) {
+    uint32_t a = adler & 0xffff, b = adler >> 16;
+    while (size > 0) {
+      // Largest run which can't overflow before the modulo.
+      const size_t run = std::min<size_t>(size, 5552);
+      for (size_t i = 0; i < run; ++i) {
+        a += data[i];
+        b += a;
+      }
+      a %= 65521;
+      b %= 65521;
+      data += run;
+      size -= run;
+    }
+    return (b << 16) | a;
+  }
+
+  void PutBigEndian(uint8_t *out, uint32_t value) {
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+  }
+
+  // Writes a PNG chunk while keeping its CRC.
+  class PngChunkWriter {
+  public:
+    PngChunkWriter(FILE *out, const char *type, uint32_t size) : out_(out), crc_(0) {
+      uint8_t length[4];
+      PutBigEndian(length, size);
+      fwrite(length, 1, 4, out_);
+      Write(reinterpret_cast<const uint8_t *>(type), 4);
+    }
+    void Write(const uint8_t *data, size_t size) {
+      crc_ = Crc32(crc_, data, size);
+      fwrite(data, 1, size, out_);
+    }
+    ~PngChunkWriter() {
+      uint8_t crc[4];
+      PutBigEndian(crc, crc_);
+      fwrite(crc, 1, 4, out_);
+    }
+  private:
+    FILE *const out_;
+    uint32_t crc_;
+  };
+
+  // 8 bits RGB image. The deflate stream is made of stored blocks:
+  // compressing would take longer than rendering and the files are
+  // meant to be converted to a video afterwards.
+  void WritePng(FILE *out, const uint8_t *rgb, uint32_t width, uint32_t height,
+                std::vector<uint8_t> *scanlines) {
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    fwrite(signature, 1, sizeof(signature), out);
+
+    {
+      uint8_t header[13];
+      PutBigEndian(header, width);
+      PutBigEndian(header + 4, height);
+      header[8] = 8;   // Bit depth.
+      header[9] = 2;   // Truecolor.
+      header[10] = 0;  // Deflate.
+      header[11] = 0;  // Adaptive filtering.
+      header[12] = 0;  // No interlace.
+      PngChunkWriter chunk(out, "IHDR", sizeof(header));
+      chunk.Write(header, sizeof(header));
+    }
+
+    // Every scanline starts with its filter type, none.
+    const size_t row_size = 3 * size_t(width);
+    scanlines->resize((row_size + 1) * height);
+    for (uint32_t y = 0; y < height; ++y) {
+      uint8_t *row = scanlines->data() + y * (row_size + 1);
+      row[0] = 0;
+      std::copy(rgb + y * row_size, rgb + (y + 1) * row_size, row + 1);
+    }
+
+    const size_t kMaxStoredBlock = 65535;
+    const size_t size = scanlines->size();
+    const size_t blocks = std::max<size_t>((size + kMaxStoredBlock - 1) / kMaxStoredBlock, 1);
+    {
+      PngChunkWriter chunk(out, "IDAT", 2 + size + 5 * blocks + 4);
+      // No preset dictionary, fastest compression level.
+      static const uint8_t zlib_header[2] = { 0x78, 0x01 };
+      chunk.Write(zlib_header, 2);
+      size_t offset = 0;
+      for (size_t i = 0; i < blocks; ++i) {
+        const uint16_t length = std::min(kMaxStoredBlock, size - offset);
+        const uint8_t block_header[5] = {
+          uint8_t(i + 1 == blocks), uint8_t(length), uint8_t(length >> 8),
+          uint8_t(~length), uint8_t(~length >> 8) };
+        chunk.Write(block_header, 5);
+        chunk.Write(scanlines->data() + offset, length);
+        offset += length;
+      }
+      uint8_t adler[4];
+      PutBigEndian(adler, Adler32(1, scanlines->data(), size));
+      chunk.Write(adler, 4);
+    }
+
+    PngChunkWriter(out, "IEND", 0);
+  }
+}
+
+FrameCapture::FrameCapture(const std::string &directory, Format format, unsigned slots)
+  : directory_(directory), format_(format), available_(slots, true),
+    encoding_(false), exit_(false), written_(0), dropped_(0), write_failed_(false),
+    thread_(&FrameCapture::EncoderLoop, this) {
+  assert(slots > 0);
+}
+
+FrameCapture::~FrameCapture() {
+  Drain();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    exit_ = true;
+  }
+  queued_.notify_one();
+  thread_.join();
+  if (dropped_ > 0) {
+    fprintf(stderr, "Capture: %llu frames written, %llu dropped.\n",
+            (unsigned long long) written_, (unsigned long long) dropped_);
+  }
+}
+
+int FrameCapture::AcquireSlot() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (size_t i = 0; i < available_.size(); ++i) {
+    if (available_[i]) {
+      available_[i] = false;
+      return i;
+    }
+  }
+  dropped_++;
+  return -1;
+}
+
+void FrameCapture::Encode(int slot, uint64_t serial, const uint8_t *pixels,
+                          uint32_t width, uint32_t height, uint32_t row_pitch, bool bgra) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    assert(!available_[slot]);
+    jobs_.push_back({slot, serial, pixels, width, height, row_pitch, bgra});
+  }
+  queued_.notify_one();
+}
+
+void FrameCapture::ReleaseSlot(int slot) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  available_[slot] = true;
+}
+
+void FrameCapture::Drain() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  idle_.wait(lock, [this]() { return jobs_.empty() && !encoding_; });
+}
+
+uint64_t FrameCapture::written() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return written_;
+}
+
+uint64_t FrameCapture::dropped() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return dropped_;
+}
+
+bool FrameCapture::ParseFormat(const std::string &name, Format *format) {
+  if (name == "png") *format = kPng;
+  else if (name == "ppm") *format = kPpm;
+  else if (name == "raw") *format = kRaw;
+  else return false;
+  return true;
+}
+
+void FrameCapture::EncoderLoop() {
+  for (;;) {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      queued_.wait(lock, [this]() { return exit_ || !jobs_.empty(); });
+      if (jobs_.empty()) return;
+      job = jobs_.front();
+      jobs_.pop_front();
+      encoding_ = true;
+    }
+
+    const bool ok = Write(job);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      available_[job.slot] = true;
+      encoding_ = false;
+      if (ok)
+        written_++;
+      else
+        dropped_++;
+    }
+    idle_.notify_all();
+  }
+}
+
+bool FrameCapture::Write(const Job &job) {
+  char name[64];
+  if (format_ == kRaw) {
+    snprintf(name, sizeof(name), "/frame-%06llu-%ux%u.rgba",
+             (unsigned long long) job.serial, job.width, job.height);
+  } else {
+    snprintf(name, sizeof(name), "/frame-%06llu.%s",
+             (unsigned long long) job.serial, format_ == kPng ? "png" : "ppm");
+  }
+  const std::string path = directory_ + name;
+
+  // Tightly packed RGB, or RGBA for the raw frames.
+  const uint32_t channels = format_ == kRaw ? 4 : 3;
+  const uint32_t r = job.bgra ? 2 : 0, b = job.bgra ? 0 : 2;
+  pixels_.resize(size_t(job.width) * job.height * channels);
+  uint8_t *dst = pixels_.data();
+  for (uint32_t y = 0; y < job.height; ++y) {
+    const uint8_t *src = job.pixels + size_t(y) * job.row_pitch;
+    for (uint32_t x = 0; x < job.width; ++x, src += 4, dst += channels) {
+      dst[0] = src[r];
+      dst[1] = src[1];
+      dst[2] = src[b];
+      if (channels == 4) dst[3] = src[3];
+    }
+  }
+
+  FILE *out = fopen(path.c_str(), "wb");
+  if (!out) {
+    // Only the first failure is reported, e.g. the disk is full.
+    if (!write_failed_) perror(path.c_str());
+    write_failed_ = true;
+    return false;
+  }
+  switch (format_) {
+  case kPng:
+    WritePng(out, pixels_.data(), job.width, job.height, &scanlines_);
+    break;
+  case kPpm:
+    fprintf(out, "P6\n%u %u\n255\n", job.width, job.height);
+    fwrite(pixels_.data(), 1, pixels_.size(), out);
+    break;
+  case kRaw:
+    fwrite(pixels_.data(), 1, pixels_.size(), out);
+    break;
+  }
+  const bool ok = !ferror(out);
+  if (fclose(out) != 0 || !ok) {
+    if (!write_failed_) perror(path.c_str());
+    write_failed_ = true;
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,99 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright(c) Leonardo Romor <leonardo.romor@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+#ifndef __FRAME_CAPTURE_H_
+#define __FRAME_CAPTURE_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Writes the rendered frames to disk from a background thread.
+// The scene copies the images into a ring of host visible buffers,
+// one per slot, and hands a slot over once the GPU is done with it.
+// The slot can't be written again until its frame is encoded, when
+// none is available the frame is dropped instead of waiting.
+class FrameCapture {
+public:
+  enum Format { kPng, kPpm, kRaw };
+
+  // Frames are written to directory, which must exist, as
+  // frame-<serial>.png, .ppm or frame-<serial>-<w>x<h>.rgba.
+  FrameCapture(const std::string &directory, Format format, unsigned slots = 3);
+  // Waits for the queued frames to be written.
+  ~FrameCapture();
+
+  unsigned slots() const { return available_.size(); }
+
+  // Take a free slot for the next frame, -1 if all of
+  // them are in use in which case the frame is dropped.
+  int AcquireSlot();
+
+  // Encode the pixels of a slot, they must stay valid until the slot
+  // is released. Rows are row_pitch bytes apart, 4 bytes per pixel,
+  // in BGRA order if bgra is set, RGBA otherwise.
+  void Encode(int slot, uint64_t serial, const uint8_t *pixels,
+              uint32_t width, uint32_t height, uint32_t row_pitch, bool bgra);
+
+  // Give back a slot which won't be encoded.
+  void ReleaseSlot(int slot);
+
+  // Block until all the queued frames are written.
+  void Drain();
+
+  uint64_t written() const;
+  uint64_t dropped() const;
+
+  // Parse png, ppm or raw.
+  static bool ParseFormat(const std::string &name, Format *format);
+
+private:
+  struct Job {
+    int slot;
+    uint64_t serial;
+    const uint8_t *pixels;
+    uint32_t width, height, row_pitch;
+    bool bgra;
+  };
+
+  void EncoderLoop();
+  bool Write(const Job &job);
+
+  const std::string directory_;
+  const Format format_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable queued_;
+  std::condition_variable idle_;
+  std::vector<bool> available_;
+  std::deque<Job> jobs_;
+  bool encoding_;
+  bool exit_;
+  uint64_t written_;
+  uint64_t dropped_;
+
+  // Used by the encoder thread only: whether a write failed
+  // already, the converted pixels of the frame being written
+  // and its PNG scanlines.
+  bool write_failed_;
+  std::vector<uint8_t> pixels_;
+  std::vector<uint8_t> scanlines_;
+  std::thread thread_;
+};
+
+#endif // __FRAME_CAPTURE_H_
@@ -0,0 +1,41 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright(c) Leonardo Romor <leonardo.romor@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+#include "frame-limiter.h"
+
+#include <errno.h>
+
+static int64_t Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+FrameLimiter::FrameLimiter(double fps)
+  : period_ns_(fps > 0 ? static_cast<int64_t>(1e9 / fps) : 0), next_ns_(0) {}
+
+void FrameLimiter::Wait() {
+  if (!enabled()) return;
+  const int64_t now = Now();
+  // Don't try to catch up after a long frame or a pause,
+  // restart from now.
+  if (next_ns_ == 0 || now - next_ns_ > period_ns_)
+    next_ns_ = now;
+
+  const struct timespec deadline = {
+    static_cast<time_t>(next_ns_ / 1000000000LL),
+    static_cast<long>(next_ns_ % 1000000000LL) };
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {}
+  next_ns_ += period_ns_;
+}
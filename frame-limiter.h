@@ -0,0 +1,40 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright(c) Leonardo Romor <leonardo.romor@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+#ifndef __FRAME_LIMITER_H_
+#define __FRAME_LIMITER_H_
+
+#include <cstdint>
+#include <time.h>
+
+// Caps the frame rate by sleeping until the start of the next frame.
+// Deadlines are absolute so that oversleeping in one frame is
+// compensated in the next one instead of accumulating.
+class FrameLimiter {
+public:
+  // A rate of 0 disables the limiter.
+  explicit FrameLimiter(double fps);
+
+  bool enabled() const { return period_ns_ > 0; }
+
+  // Sleep until the next frame is due.
+  void Wait();
+
+private:
+  int64_t period_ns_;
+  // Deadline of the next frame, 0 before the first one.
+  int64_t next_ns_;
+};
+
+#endif // __FRAME_LIMITER_H_
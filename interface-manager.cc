@@ -16,6 +16,7 @@
 #include <cmath>
 
 #define XK_MISCELLANY
+#define XK_LATIN1
 #include <X11/Xlib.h>
 #include <X11/keysymdef.h>
 #include <X11/XKBlib.h>
@@ -27,7 +28,7 @@ InterfaceManager::InterfaceManager(Display *display, Window window,
                                    Gamepad *gamepad)
     : display_(display), window_(window), scene_(scene),
       camera_(camera), xinput2_(xinput2), gamepad_(gamepad),
-      gamepad_state_({}), mouse_state_(0), exit_(false) {
+      gamepad_state_({}), mouse_state_(0), exit_(false), export_profile_(false) {
 
   // Register events for gamepad
   if (gamepad)
@@ -84,11 +85,18 @@ InterfaceManager::InterfaceManager(Display *display, Window window,
   xinput2->OnKeyEvent([&](XInput2 *xinput2,
                           const XInput2::KeyButtonEventType e,
                           const unsigned int b) {
-    DispatchKeyPressEvent(b);
+    DispatchKeyPressEvent(e, b);
   });
 }
 
+bool InterfaceManager::Animating() const {
+  return gamepad_state_.axis_left_x_ != 0.0f || gamepad_state_.axis_left_y_ != 0.0f
+    || gamepad_state_.axis_right_x_ != 0.0f || gamepad_state_.axis_right_y_ != 0.0f;
+}
+
 void InterfaceManager::UpdateScene(double dt) {
+  // Moving by zero would still count as a camera change.
+  if (!Animating()) return;
   camera_->FirstPersonControlMove(gamepad_state_.axis_left_x_ * dt, gamepad_state_.axis_left_y_ * dt);
   camera_->FirstPersonControlRotate(gamepad_state_.axis_right_x_ * dt, gamepad_state_.axis_right_y_ * dt);
 }
@@ -140,10 +148,16 @@ void InterfaceManager::DispatchWheelEvent(float dz) {
   camera_->TrackballControlZoom(dz);
 }
 
-void InterfaceManager::DispatchKeyPressEvent(unsigned int keysim) {
+void InterfaceManager::DispatchKeyPressEvent(
+  XInput2::KeyButtonEventType e, unsigned int keysim) {
   switch (keysim) {
     case XK_Escape:
       exit_ = true;
       break;
+    case XK_p:
+      // Once per keystroke, not again on release.
+      if (e == XInput2::KeyButtonEventType::kButtonPressed)
+        export_profile_ = true;
+      break;
   }
 }
@@ -17,6 +17,7 @@
 
 #include <X11/Xlib.h>
 #include <chrono>
+#include <utility>
 #include "scene.h"
 #include "input/xinput2.h"
 #include "input/gamepad.h"
@@ -29,8 +30,14 @@ class InterfaceManager {
                    XInput2 *xinput2, Gamepad *gamepad);
 
   bool Exit() { return exit_; }
+  // Whether the profile export key was pressed since the last call.
+  bool ExportProfile() { return std::exchange(export_profile_, false); }
   void UpdateScene(double dt);
 
+  // Whether the scene keeps changing without any input,
+  // e.g. a gamepad stick is held.
+  bool Animating() const;
+
  private:
   Display *display_;
   Window window_;
@@ -54,6 +61,7 @@ class InterfaceManager {
 
   int mouse_state_;
   bool exit_;
+  bool export_profile_;
 
   // Mouse pointer stuff
   void EnableDragMode1();
@@ -61,7 +69,7 @@ class InterfaceManager {
   void DisableDragMode();
   void DispatchPointerMotionEvent(double dx, double dy);
   void DispatchWheelEvent(float dz);
-  void DispatchKeyPressEvent(unsigned int keysim);
+  void DispatchKeyPressEvent(XInput2::KeyButtonEventType e, unsigned int keysim);
 
 };
 #endif // _INTERFACE_MANAGER_H
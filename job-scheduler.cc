@@ -0,0 +1,78 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright(c) Leonardo Romor <leonardo.romor@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+#include "job-scheduler.h"
+
+#include <algorithm>
+
+JobScheduler::JobScheduler(unsigned num_workers)
+  : job_(nullptr), generation_(0), pending_(0), exit_(false) {
+  if (num_workers == 0)
+    num_workers = std::max(std::thread::hardware_concurrency(), 1u);
+  for (unsigned i = 1; i < num_workers; ++i)
+    threads_.emplace_back(&JobScheduler::WorkerLoop, this, i);
+}
+
+JobScheduler::~JobScheduler() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    exit_ = true;
+  }
+  start_.notify_all();
+  for (auto &thread : threads_)
+    thread.join();
+}
+
+void JobScheduler::RunOnAllWorkers(const Job &job) {
+  if (threads_.empty()) {
+    job(0);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    job_ = &job;
+    pending_ = threads_.size();
+    generation_++;
+  }
+  start_.notify_all();
+
+  job(0);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_.wait(lock, [this]() { return pending_ == 0; });
+  job_ = nullptr;
+}
+
+void JobScheduler::WorkerLoop(unsigned worker_index) {
+  uint64_t generation = 0;
+  for (;;) {
+    const Job *job;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      start_.wait(lock, [&]() { return exit_ || generation_ != generation; });
+      if (exit_) return;
+      generation = generation_;
+      job = job_;
+    }
+
+    (*job)(worker_index);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_--;
+    }
+    done_.notify_one();
+  }
+}
@@ -0,0 +1,57 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright(c) Leonardo Romor <leonardo.romor@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+#ifndef __JOB_SCHEDULER_H_
+#define __JOB_SCHEDULER_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of workers running a job in parallel. Worker 0 is the
+// calling thread, the others are long lived threads so that resources
+// which are not thread safe (e.g. command pools) can be bound to a
+// worker index.
+class JobScheduler {
+public:
+  typedef std::function<void(unsigned worker_index)> Job;
+
+  // 0 uses as many workers as hardware threads.
+  explicit JobScheduler(unsigned num_workers = 0);
+  ~JobScheduler();
+
+  unsigned num_workers() const { return threads_.size() + 1; }
+
+  // Run the job once on every worker and wait for all of them.
+  void RunOnAllWorkers(const Job &job);
+
+private:
+  void WorkerLoop(unsigned worker_index);
+
+  std::vector<std::thread> threads_;
+
+  std::mutex mutex_;
+  std::condition_variable start_;
+  std::condition_variable done_;
+  const Job *job_;
+  // Incremented for each job so that workers run it only once.
+  uint64_t generation_;
+  unsigned pending_;
+  bool exit_;
+};
+
+#endif // __JOB_SCHEDULER_H_
@@ -0,0 +1,405 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright(c) Leonardo Romor <leonardo.romor@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+//
+// Microbenchmarks of the CPU hot paths. The harness mimics
+// google-benchmark: a function taking a State is registered with
+// the argument sets to run it with, the State loop is timed and the
+// number of iterations grows until the run is long enough.
+#include <getopt.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <vulkan/vulkan.hpp>
+
+#include "camera.h"
+#include "curve.h"
+#include "vulkan-core.h"
+#include "shaders/curve.vert.h"
+#include "shaders/curve.frag.h"
+
+namespace {
+  typedef std::chrono::steady_clock Clock;
+
+  template <typename T>
+  inline void DoNotOptimize(T const& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+  }
+
+  class State {
+  public:
+    State(uint64_t iterations, const std::vector<int64_t> &args)
+      : args_(args), iterations_(iterations), remaining_(iterations),
+        running_(false), elapsed_(0) {}
+
+    // Loop condition of the timed section.
+    bool KeepRunning() {
+      if (!running_ && remaining_ == iterations_) ResumeTiming();
+      if (remaining_ > 0 && error_.empty()) {
+        remaining_--;
+        return true;
+      }
+      if (running_) PauseTiming();
+      return false;
+    }
+
+    // Exclude the setup done inside the loop.
+    void PauseTiming() {
+      elapsed_ += Clock::now() - start_;
+      running_ = false;
+    }
+    void ResumeTiming() {
+      start_ = Clock::now();
+      running_ = true;
+    }
+
+    void SkipWithError(const std::string &error) { error_ = error; }
+
+    int64_t range(size_t i) const { return args_[i]; }
+    uint64_t iterations() const { return iterations_; }
+    double seconds() const { return std::chrono::duration<double>(elapsed_).count(); }
+    const std::string &error() const { return error_; }
+
+  private:
+    const std::vector<int64_t> args_;
+    const uint64_t iterations_;
+    uint64_t remaining_;
+    bool running_;
+    Clock::time_point start_;
+    Clock::duration elapsed_;
+    std::string error_;
+  };
+
+  struct Benchmark {
+    std::string name;
+    std::function<void(State &)> function;
+    std::vector<std::vector<int64_t>> args;
+  };
+
+  std::vector<Benchmark> &Registry() {
+    static std::vector<Benchmark> registry;
+    return registry;
+  }
+
+  struct Registration {
+    Registration(const char *name, std::function<void(State &)> function,
+                 std::vector<std::vector<int64_t>> args) {
+      if (args.empty()) args.push_back({});
+      Registry().push_back({name, function, args});
+    }
+  };
+
+#define BENCHMARK(function, ...) \
+  static Registration function##_registration(#function, function, { __VA_ARGS__ })
+
+  // Shared headless context for the benchmarks needing a device,
+  // null if vulkan couldn't be initialized.
+  space::core::VkAppContext *Context() {
+    static std::optional<space::core::VkAppContext> context = []() {
+      const struct space::core::VkAppConfig config = {
+        "SpaceMicrobench", "SpaceEngine", {}, {}};
+      return space::core::InitVulkan(config);
+    }();
+    return context ? &*context : nullptr;
+  }
+
+  std::vector<Point> ControlPoints(size_t count) {
+    std::vector<Point> points;
+    for (size_t i = 0; i < count; ++i)
+      points.push_back({ std::cos(0.7f * i), 0.1f * i, std::sin(0.7f * i) });
+    return points;
+  }
+
+  // Evenly spread t values without a division in the loop.
+  inline float NextT(float t) {
+    t += 0.618034f;
+    return t >= 1.0f ? t - 1.0f : t;
+  }
+}
+
+// Args: degree, number of control points.
+static void BM_NURBSEvaluate(State &state) {
+  const NURBS f(ControlPoints(state.range(1)), state.range(0));
+  float t = 0;
+  while (state.KeepRunning()) {
+    DoNotOptimize(f(t));
+    t = NextT(t);
+  }
+}
+BENCHMARK(BM_NURBSEvaluate, {2, 8}, {3, 8}, {3, 64}, {5, 64}, {3, 512});
+
+// Args: degree. A single span, as evaluated by NURBS.
+static void BM_DeBoor(State &state) {
+  const unsigned p = state.range(0);
+  const std::vector<Point> points = ControlPoints(p + 1);
+  std::vector<float> knots;
+  for (unsigned i = 0; i < 2 * p; ++i)
+    knots.push_back(static_cast<float>(i) / (2 * p - 1));
+  const float t_begin = knots[p - 1];
+  const float t_span = knots[p] - knots[p - 1];
+  float t = 0;
+  while (state.KeepRunning()) {
+    DoNotOptimize(DeBoor(t_begin + t * t_span, points, knots, p));
+    t = NextT(t);
+  }
+}
+BENCHMARK(BM_DeBoor, {1}, {2}, {3}, {5}, {8});
+
+// What Curve::Register does on the CPU.
+// Args: number of control points, steps.
+static void BM_CurveSampling(State &state) {
+  const NURBS f(ControlPoints(state.range(0)), 3);
+  while (state.KeepRunning()) {
+    const std::vector<Point> points = SampleCurve(f, state.range(1));
+    DoNotOptimize(LineListIndices(points.size()));
+  }
+}
+BENCHMARK(BM_CurveSampling, {7, 1000}, {64, 1000}, {64, 10000});
+
+// Args: number of points.
+static void BM_LineListIndices(State &state) {
+  while (state.KeepRunning())
+    DoNotOptimize(LineListIndices(state.range(0)));
+}
+BENCHMARK(BM_LineListIndices, {1001}, {10001}, {60001});
+
+static void BM_CameraProjectionMatrices(State &state) {
+  Camera camera;
+  while (state.KeepRunning())
+    DoNotOptimize(camera.GetProjectionMatrices(16.0f / 9.0f));
+}
+BENCHMARK(BM_CameraProjectionMatrices);
+
+static void BM_CameraTrackballRotate(State &state) {
+  Camera camera;
+  while (state.KeepRunning())
+    camera.TrackballControlRotate(0.01f, 0.005f);
+  DoNotOptimize(camera.GetProjectionMatrices(1.0f));
+}
+BENCHMARK(BM_CameraTrackballRotate);
+
+static void BM_CameraTrackballPan(State &state) {
+  Camera camera;
+  float direction = 1.0f;
+  while (state.KeepRunning()) {
+    camera.TrackballControlPan(0.01f * direction, 0.01f);
+    direction = -direction;
+  }
+  DoNotOptimize(camera.GetProjectionMatrices(1.0f));
+}
+BENCHMARK(BM_CameraTrackballPan);
+
+static void BM_CameraTrackballZoom(State &state) {
+  Camera camera;
+  // Zoom in and out to stay in the same range.
+  float zoom = 1.0f;
+  while (state.KeepRunning()) {
+    camera.TrackballControlZoom(zoom);
+    zoom = -zoom;
+  }
+  DoNotOptimize(camera.GetProjectionMatrices(1.0f));
+}
+BENCHMARK(BM_CameraTrackballZoom);
+
+static void BM_CameraFirstPersonMove(State &state) {
+  Camera camera;
+  float direction = 1.0f;
+  while (state.KeepRunning()) {
+    camera.FirstPersonControlMove(0.01f, 0.01f * direction);
+    direction = -direction;
+  }
+  DoNotOptimize(camera.GetProjectionMatrices(1.0f));
+}
+BENCHMARK(BM_CameraFirstPersonMove);
+
+static void BM_CameraFirstPersonRotate(State &state) {
+  Camera camera;
+  while (state.KeepRunning())
+    camera.FirstPersonControlRotate(0.01f, 0.005f);
+  DoNotOptimize(camera.GetProjectionMatrices(1.0f));
+}
+BENCHMARK(BM_CameraFirstPersonRotate);
+
+static void BM_CameraFirstPersonCenter(State &state) {
+  Camera camera;
+  while (state.KeepRunning())
+    camera.FirstPersonControlCenter(0.01f, 0.005f);
+  DoNotOptimize(camera.GetProjectionMatrices(1.0f));
+}
+BENCHMARK(BM_CameraFirstPersonCenter);
+
+// Args: number of points, stride in bytes.
+static void BM_CopyToDevice(State &state) {
+  space::core::VkAppContext *context = Context();
+  if (!context) return state.SkipWithError("no vulkan device");
+  const std::vector<Point> points = ControlPoints(state.range(0));
+  const size_t stride = state.range(1);
+  space::core::BufferData buffer(
+    context->physical_device, context->device, points.size() * stride,
+    vk::BufferUsageFlagBits::eVertexBuffer,
+    vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
+    "microbench");
+  while (state.KeepRunning()) {
+    space::core::CopyToDevice(
+      context->device, buffer.deviceMemory, points.data(), points.size(), stride);
+  }
+}
+BENCHMARK(BM_CopyToDevice, {1024, sizeof(Point)}, {1024, 16},
+          {65536, sizeof(Point)}, {65536, 16});
+
+// Args: 0 for a new pipeline cache each time, 1 for a cache which
+// already contains the pipeline. The driver might have its own
+// cache on disk, so cold is not necessarily a full compilation.
+static void BM_GraphicsPipelineCreate(State &state) {
+  space::core::VkAppContext *context = Context();
+  if (!context) return state.SkipWithError("no vulkan device");
+  vk::UniqueDevice &device = context->device;
+  const bool warm = state.range(0);
+
+  vk::UniqueRenderPass render_pass = space::core::CreateRenderPass(
+    device, vk::Format::eR8G8B8A8Unorm, vk::Format::eD16Unorm,
+    vk::AttachmentLoadOp::eClear, vk::ImageLayout::eTransferSrcOptimal);
+  vk::UniqueDescriptorSetLayout descriptor_set_layout =
+    space::core::CreateDescriptorSetLayout(
+      device, { {vk::DescriptorType::eUniformBufferDynamic, 1, vk::ShaderStageFlagBits::eVertex} });
+  const vk::PushConstantRange draw_constants_range = space::DrawConstantsRange();
+  vk::UniquePipelineLayout pipeline_layout =
+    device->createPipelineLayoutUnique(
+      vk::PipelineLayoutCreateInfo(
+        vk::PipelineLayoutCreateFlags(), 1, &descriptor_set_layout.get(),
+        1, &draw_constants_range));
+  vk::UniqueShaderModule vertex =
+    device->createShaderModuleUnique(
+      vk::ShaderModuleCreateInfo(
+        vk::ShaderModuleCreateFlags(), sizeof(curve_vert), curve_vert));
+  vk::UniqueShaderModule frag =
+    device->createShaderModuleUnique(
+      vk::ShaderModuleCreateInfo(
+        vk::ShaderModuleCreateFlags(), sizeof(curve_frag), curve_frag));
+
+  auto create = [&](vk::UniquePipelineCache *cache) {
+    return space::core::GraphicsPipelineBuilder(&device, &pipeline_layout, &render_pass)
+      .DepthBuffered(true)
+      .SetPrimitiveTopology(vk::PrimitiveTopology::eLineList)
+      .SetPolygoneMode(vk::PolygonMode::eLine)
+      .AddVertexShader(*vertex)
+      .AddFragmentShader(*frag)
+      .AddVertexInputBindingDescription(0, sizeof(Point), vk::VertexInputRate::eVertex)
+      .AddVertexInputAttributeDescription(0, 0, vk::Format::eR32G32B32Sfloat, 0)
+      .EnableDynamicState(vk::DynamicState::eScissor)
+      .EnableDynamicState(vk::DynamicState::eViewport)
+      .EnableDynamicState(vk::DynamicState::eLineWidth)
+      .Create(cache);
+  };
+
+  vk::UniquePipelineCache cache = device->createPipelineCacheUnique(vk::PipelineCacheCreateInfo());
+  if (warm) create(&cache);
+  while (state.KeepRunning()) {
+    if (!warm) {
+      state.PauseTiming();
+      cache = device->createPipelineCacheUnique(vk::PipelineCacheCreateInfo());
+      state.ResumeTiming();
+    }
+    DoNotOptimize(create(&cache));
+  }
+}
+BENCHMARK(BM_GraphicsPipelineCreate, {0}, {1});
+
+static int usage(const char *prog, const char *msg) {
+  if (msg) {
+    fprintf(stderr, "\033[1m\033[31m%s\033[0m\n\n", msg);
+  }
+  fprintf(stderr, "Usage: %s [options]\n"
+          "Options:\n", prog);
+  fprintf(stderr,
+          "\t    --filter <text>      : Only run the benchmarks whose name contains <text>.\n"
+          "\t    --min-time <secs>    : Minimum time spent in each benchmark (default 0.5).\n"
+          "\t-h, --help               : Display this help text and exit.\n");
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  std::string filter;
+  double min_time = 0.5;
+
+  enum LongOptionsOnly {
+    OPT_FILTER = 1000,
+    OPT_MIN_TIME,
+  };
+
+  static struct option long_options[] = {
+    { "help",     no_argument,       NULL, 'h' },
+    { "filter",   required_argument, NULL, OPT_FILTER },
+    { "min-time", required_argument, NULL, OPT_MIN_TIME },
+    { 0,          0,                 0,    0  },
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'h':
+      return usage(argv[0], NULL);
+    case OPT_FILTER:
+      filter = optarg;
+      break;
+    case OPT_MIN_TIME:
+      min_time = atof(optarg);
+      if (min_time <= 0)
+        return usage(argv[0], "Invalid minimum time.");
+      break;
+    default:
+      return usage(argv[0], "Unkown or invalid option.");
+    }
+  }
+
+  fprintf(stdout, "%-44s %14s %14s\n", "Benchmark", "Time/iter", "Iterations");
+  for (const auto &benchmark : Registry()) {
+    for (const auto &args : benchmark.args) {
+      std::string name = benchmark.name;
+      for (int64_t arg : args) name += "/" + std::to_string(arg);
+      if (name.find(filter) == std::string::npos) continue;
+
+      // Grow the iterations until the run takes long enough.
+      uint64_t iterations = 1;
+      for (;;) {
+        State state(iterations, args);
+        benchmark.function(state);
+        if (!state.error().empty()) {
+          fprintf(stdout, "%-44s ERROR: %s\n", name.c_str(), state.error().c_str());
+          break;
+        }
+        const double seconds = state.seconds();
+        if (seconds >= min_time || iterations >= 1000000000) {
+          const double ns = seconds * 1e9 / iterations;
+          fprintf(stdout, "%-44s %11.1f ns %14llu\n",
+                  name.c_str(), ns, (unsigned long long) iterations);
+          break;
+        }
+        const double factor = seconds > 0 ? 1.4 * min_time / seconds : 10;
+        iterations = std::min<uint64_t>(
+          1000000000, std::max<uint64_t>(iterations + 1, iterations * std::min(factor, 10.0)));
+      }
+    }
+  }
+  return 0;
+}
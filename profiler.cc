@@ -0,0 +1,129 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright(c) Leonardo Romor <leonardo.romor@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+#include "profiler.h"
+
+#include <algorithm>
+#include <cstdio>
+
+Profiler::Profiler(size_t window, size_t max_events)
+  : window_(window), max_events_(max_events), epoch_(Clock::now()), next_event_(0) {
+  events_.reserve(max_events_);
+}
+
+int Profiler::Series(const std::string &name, Track track) {
+  for (size_t i = 0; i < series_.size(); ++i) {
+    if (series_[i].name == name) return i;
+  }
+  series_.push_back(SeriesData{name, track, std::vector<double>(window_), 0, 0});
+  return series_.size() - 1;
+}
+
+void Profiler::Record(int series, Clock::time_point start, double duration_ms) {
+  SeriesData &data = series_[series];
+  data.samples[data.next] = duration_ms;
+  data.next = (data.next + 1) % window_;
+  data.count++;
+
+  const Event event{series, start, duration_ms};
+  if (events_.size() < max_events_) {
+    events_.push_back(event);
+  } else {
+    events_[next_event_] = event;
+    next_event_ = (next_event_ + 1) % max_events_;
+  }
+}
+
+double Profiler::Last(int series) const {
+  const SeriesData &data = series_[series];
+  if (data.count == 0) return 0;
+  return data.samples[(data.next + window_ - 1) % window_];
+}
+
+void Profiler::Reset() {
+  for (auto &data : series_) {
+    data.next = 0;
+    data.count = 0;
+  }
+  events_.clear();
+  next_event_ = 0;
+}
+
+std::vector<Profiler::Summary> Profiler::Summarize() const {
+  std::vector<Summary> summaries;
+  for (const auto &data : series_) {
+    const size_t n = std::min(data.count, window_);
+    Summary summary{data.name, n, 0, 0, 0, 0, 0};
+    if (n > 0) {
+      std::vector<double> sorted(data.samples.begin(), data.samples.begin() + n);
+      std::sort(sorted.begin(), sorted.end());
+      auto percentile = [&sorted](double p) {
+        return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+      };
+      for (double sample : sorted) summary.mean += sample;
+      summary.mean /= n;
+      summary.p50 = percentile(0.50);
+      summary.p95 = percentile(0.95);
+      summary.p99 = percentile(0.99);
+      summary.max = sorted.back();
+    }
+    summaries.push_back(summary);
+  }
+  return summaries;
+}
+
+bool Profiler::WriteCsv(const std::string &path) const {
+  FILE *out = fopen(path.c_str(), "w");
+  if (!out) {
+    perror(path.c_str());
+    return false;
+  }
+  fprintf(out, "name,count,mean_ms,p50_ms,p95_ms,p99_ms,max_ms\n");
+  for (const auto &s : Summarize()) {
+    fprintf(out, "%s,%zu,%.4f,%.4f,%.4f,%.4f,%.4f\n",
+            s.name.c_str(), s.count, s.mean, s.p50, s.p95, s.p99, s.max);
+  }
+  return fclose(out) == 0;
+}
+
+bool Profiler::WriteChromeTrace(const std::string &path) const {
+  FILE *out = fopen(path.c_str(), "w");
+  if (!out) {
+    perror(path.c_str());
+    return false;
+  }
+  fprintf(out, "{\"traceEvents\":[\n");
+  fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+          "\"args\":{\"name\":\"CPU\"}},\n", kCpuTrack);
+  fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+          "\"args\":{\"name\":\"GPU\"}}", kGpuTrack);
+  // Oldest first once the ring has wrapped.
+  for (size_t i = 0; i < events_.size(); ++i) {
+    const Event &event = events_[(next_event_ + i) % events_.size()];
+    const SeriesData &data = series_[event.series];
+    const double ts = std::chrono::duration<double, std::micro>(event.start - epoch_).count();
+    fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+            "\"ts\":%.3f,\"dur\":%.3f}",
+            data.name.c_str(), data.track, ts, event.duration_ms * 1000.0);
+  }
+  fprintf(out, "\n]}\n");
+  return fclose(out) == 0;
+}
+
+bool Profiler::Export(const std::string &prefix) const {
+  const bool ok = WriteCsv(prefix + ".csv") && WriteChromeTrace(prefix + ".json");
+  if (ok)
+    fprintf(stderr, "Profile written to %s.csv and %s.json\n", prefix.c_str(), prefix.c_str());
+  return ok;
+}
@@ -0,0 +1,102 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright(c) Leonardo Romor <leonardo.romor@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+#ifndef __PROFILER_H_
+#define __PROFILER_H_
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Collects the duration of the CPU phases and GPU passes of the last
+// frames. Every series keeps a rolling window of samples from which
+// the percentiles are computed, the most recent events are kept to be
+// exported as a Chrome trace (chrome://tracing, ui.perfetto.dev).
+// Not thread safe, samples are recorded by the main thread.
+class Profiler {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  // Where the events are displayed in the trace.
+  enum Track { kCpuTrack = 1, kGpuTrack = 2 };
+
+  explicit Profiler(size_t window = 1000, size_t max_events = 100000);
+
+  // Returns the id of the series with the given name, created if needed.
+  int Series(const std::string &name, Track track = kCpuTrack);
+
+  // Add a sample, start is the time the event began.
+  void Record(int series, Clock::time_point start, double duration_ms);
+
+  // Times the enclosing scope. A null profiler does nothing.
+  class Scope {
+  public:
+    Scope(Profiler *profiler, int series)
+      : profiler_(profiler), series_(series),
+        start_(profiler ? Clock::now() : Clock::time_point()) {}
+    ~Scope() {
+      if (!profiler_) return;
+      const auto end = Clock::now();
+      profiler_->Record(
+        series_, start_, std::chrono::duration<double, std::milli>(end - start_).count());
+    }
+  private:
+    Profiler *const profiler_;
+    const int series_;
+    const Clock::time_point start_;
+  };
+
+  struct Summary {
+    std::string name;
+    size_t count;
+    double mean, p50, p95, p99, max;
+  };
+  // Statistics of the samples in the window, in milliseconds.
+  std::vector<Summary> Summarize() const;
+  // Most recent sample of the series, 0 if none.
+  double Last(int series) const;
+  // Drop all the samples and events, the series are kept.
+  void Reset();
+
+  bool WriteCsv(const std::string &path) const;
+  bool WriteChromeTrace(const std::string &path) const;
+  // Write <prefix>.csv and <prefix>.json.
+  bool Export(const std::string &prefix) const;
+
+private:
+  struct SeriesData {
+    std::string name;
+    Track track;
+    // Ring of the last window_ samples.
+    std::vector<double> samples;
+    size_t next;
+    size_t count;
+  };
+  struct Event {
+    int series;
+    Clock::time_point start;
+    double duration_ms;
+  };
+
+  const size_t window_;
+  const size_t max_events_;
+  const Clock::time_point epoch_;
+  std::vector<SeriesData> series_;
+  // Ring of the last max_events_ events.
+  std::vector<Event> events_;
+  size_t next_event_;
+};
+
+#endif // __PROFILER_H_
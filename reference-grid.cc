@@ -27,33 +27,40 @@ void ReferenceGrid::Register(
 
 
   // Instantiate the shaders
-  vk::UniqueShaderModule vertex =
-    context->device->createShaderModuleUnique(
-      vk::ShaderModuleCreateInfo(
-        vk::ShaderModuleCreateFlags(), sizeof(grid_vert), grid_vert));
-
-  vk::UniqueShaderModule frag =
-    context->device->createShaderModuleUnique(
-      vk::ShaderModuleCreateInfo(
-        vk::ShaderModuleCreateFlags(), sizeof(grid_frag), grid_frag));
-
+  if (!vertex_shader_) {
+    vertex_shader_ = context->shader_library->Get(context->device, grid_vert);
+    fragment_shader_ = context->shader_library->Get(context->device, grid_frag);
+  }
 
+  const vk::ShaderStageFlagBits fragment = vk::ShaderStageFlagBits::eFragment;
   pipeline_ = space::core::GraphicsPipelineBuilder(
     &context->device, pipeline_layout, render_pass, nsamples)
+    // Tested against the opaque geometry drawn before,
+    // but doesn't hide what is behind the lines.
     .DepthBuffered(true)
+    .DepthWrite(false)
+    .AlphaBlending(true)
     .SetPrimitiveTopology(vk::PrimitiveTopology::eTriangleList)
     .SetPolygoneMode(vk::PolygonMode::eFill)
-    .AddVertexShader(*vertex)
-    .AddFragmentShader(*frag)
+    .AddVertexShader(vertex_shader_)
+    .AddFragmentShader(fragment_shader_)
+    .AddSpecializationConstant(fragment, 0, style_.min_cell_pixels)
+    .AddSpecializationConstant(fragment, 1, style_.line_width)
+    .AddSpecializationConstant(fragment, 2, style_.color[0])
+    .AddSpecializationConstant(fragment, 3, style_.color[1])
+    .AddSpecializationConstant(fragment, 4, style_.color[2])
+    .AddSpecializationConstant(fragment, 5, style_.color[3])
     .EnableDynamicState(vk::DynamicState::eScissor)
     .EnableDynamicState(vk::DynamicState::eViewport)
-    .Create(pipeline_cache);
+    .CreateAsync(context->pipeline_compiler.get(), pipeline_cache);
 }
 
 void ReferenceGrid::Draw(const vk::UniqueCommandBuffer *command_buffer) {
+  // The compilation failed.
+  if (!pipeline_.get()) return;
   (*command_buffer)->bindPipeline(
     vk::PipelineBindPoint::eGraphics, pipeline_.get());
 
-  (*command_buffer)->draw(6, 1, 0, 0);
+  (*command_buffer)->draw(3, 1, 0, 0);
 }
 
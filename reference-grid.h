@@ -20,9 +20,21 @@
 #include "vulkan-core.h"
 #include "entity.h"
 
+// Look of the grid, compiled into its pipeline.
+struct ReferenceGridStyle {
+  // Finest lines are at least this many pixels apart.
+  float min_cell_pixels = 8.0f;
+  // In pixels.
+  float line_width = 1.0f;
+  float color[4] = { 0.6f, 0.6f, 0.6f, 0.8f };
+};
+
+// Infinite grid on the y = 0 plane. It is drawn as a single
+// triangle covering the viewport, the plane is found per pixel.
 class ReferenceGrid : public space::Entity {
 public:
   ReferenceGrid() {}
+  explicit ReferenceGrid(const ReferenceGridStyle &style) : style_(style) {}
   virtual void Register(
     space::core::VkAppContext *context,
     vk::UniquePipelineLayout *pipeline_layout,
@@ -34,8 +46,16 @@ public:
   // Draw in the command buffer
   virtual void Draw(const vk::UniqueCommandBuffer *command_buffer) final;
 
+  virtual bool Transparent() const final { return true; }
+
+  virtual bool Ready() const final { return pipeline_.ready(); }
+  virtual const void *PipelineId() const final { return pipeline_.id(); }
+
 private:
-  vk::UniquePipeline pipeline_;
+  const ReferenceGridStyle style_;
+  space::core::PipelineCompiler::Future pipeline_;
+  space::core::ShaderLibrary::Handle vertex_shader_;
+  space::core::ShaderLibrary::Handle fragment_shader_;
 };
 
 #endif // __REFERENCE_GRID_H_
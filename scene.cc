@@ -17,9 +17,14 @@
 // This file contains the basic ingredients to render a basic wireframed scene.
 // This simple scene allows you to add meshes and a freely "movable" camera.
 #include <glm/ext/quaternion_geometric.hpp>
-#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <optional>
+#include <string>
 #include <X11/Xlib.h>
 #include <vulkan/vulkan.hpp>
 #include <numeric>
@@ -31,12 +36,71 @@
 #include "vulkan-core.h"
 #include "scene.h"
 
-#define FENCE_TIMEOUT 100000000
+// Content of each slice of the uniform buffer.
+struct UniformData {
+  glm::mat4x4 mvp;
+  // To unproject the pixels, e.g. for the reference grid.
+  glm::mat4x4 inverse_mvp;
+};
+
+// The encoder only handles 8 bits RGBA and BGRA pixels.
+static bool IsCapturable(vk::Format format) {
+  return format == vk::Format::eB8G8R8A8Unorm || format == vk::Format::eB8G8R8A8Srgb
+    || format == vk::Format::eR8G8B8A8Unorm || format == vk::Format::eR8G8B8A8Srgb;
+}
 
-Scene::Scene(space::core::VkAppContext *vk_ctx, Camera *camera, const QueryExtentCallback &fn)
-  : vk_ctx_(vk_ctx),  QueryExtent(fn), current_buffer_(0),
-    draw_fence_(vk_ctx->device->createFenceUnique(vk::FenceCreateInfo())),
-    camera_(camera) {}
+Scene::Scene(space::core::VkAppContext *vk_ctx, Camera *camera, const QueryExtentCallback &fn,
+             const SceneConfig &config)
+  : vk_ctx_(vk_ctx),  QueryExtent(fn), record_scheduler_(config.record_threads),
+    pipeline_cache_path_(config.pipeline_cache_path), pipeline_cache_dirty_(false),
+    frames_in_flight_(config.frames_in_flight),
+    present_mode_(config.present_mode), swapchain_images_(config.swapchain_images),
+    // Automatic sampling starts from 4x.
+    samples_(config.samples ? config.samples : 4),
+    auto_samples_(config.samples == 0 && !config.dynamic_resolution),
+    frame_time_budget_ms_(config.frame_time_budget_ms),
+    auto_samples_time_(0), auto_samples_frames_(0),
+    scaled_(config.dynamic_resolution || config.render_scale != 1.0f),
+    dynamic_resolution_(config.dynamic_resolution),
+    min_render_scale_(config.min_render_scale),
+    render_scale_(config.dynamic_resolution ? 1.0f : config.render_scale),
+    render_time_average_(0), frames_at_scale_(0),
+    headless_(!vk_ctx->surface),
+    frame_index_(0), semaphore_pool_(vk_ctx->device), fence_pool_(vk_ctx->device),
+    frame_serial_(0), completed_serial_(0), steady_state_sync_objects_(0),
+    steady_state_serial_(config.frames_in_flight), sync_object_regressions_(0),
+    uniform_slice_size_(0), uniform_mapping_(nullptr), current_buffer_(0),
+    recreate_swap_chain_(false), dirty_(true), camera_version_(0), camera_(camera),
+    profiler_(config.profiler), profiler_series_{-1, -1, -1, -1, -1, -1, -1, {}},
+    timestamp_valid_bits_(0), timestamp_period_(0), timestamp_capacity_(0),
+    gpu_frame_time_(0), capture_(config.capture) {
+  assert(frames_in_flight_ > 0);
+  assert(render_scale_ > 0 && render_scale_ <= 1);
+  if (profiler_) {
+    profiler_series_.frame_wait = profiler_->Series("frame-wait");
+    profiler_series_.uniform_upload = profiler_->Series("uniform-upload");
+    profiler_series_.acquire = profiler_->Series("acquire");
+    profiler_series_.record = profiler_->Series("record");
+    profiler_series_.submit = profiler_->Series("submit");
+    profiler_series_.present = profiler_->Series("present");
+    profiler_series_.gpu_render_pass =
+      profiler_->Series("gpu-render-pass", Profiler::kGpuTrack);
+  }
+}
+
+Scene::~Scene() {
+  // The pipelines being compiled refer to the layout and render pass.
+  vk_ctx_->pipeline_compiler->WaitIdle();
+  // Frames might still be in flight.
+  vk_ctx_->device->waitIdle();
+  // The encoder reads the capture buffers.
+  if (capture_) {
+    for (auto &frame : frames_)
+      EncodeCapture(frame);
+    capture_->Drain();
+  }
+  FlushPipelineCache();
+}
 
 void Scene::Init() {
   vk::UniqueDevice &device = vk_ctx_->device;
@@ -44,24 +108,109 @@ void Scene::Init() {
   const uint32_t graphics_queue_family_index = vk_ctx_->graphics_queue_family_index;
   const uint32_t present_queue_family_index = vk_ctx_->present_queue_family_index;
 
-  // For multi threaded applications, we should create a command pool
-  // for each thread. For this example, we just need one as we go
-  // with async single core app.
+  // The main thread records the primary command buffers,
+  // the entities are recorded by the workers with their own pool.
   command_pool_ =
     space::core::CreateCommandPool(vk_ctx_->device, graphics_queue_family_index);
+  for (uint32_t i = 0; i < record_scheduler_.num_workers(); ++i) {
+    record_command_pools_.push_back(
+      space::core::CreateCommandPool(vk_ctx_->device, graphics_queue_family_index));
+  }
   graphics_queue_ = device->getQueue(graphics_queue_family_index, 0);
   present_queue_ = device->getQueue(present_queue_family_index, 0);
 
+  // Everything a frame needs to be prepared independently of the others.
+  // The image acquired semaphores are taken from the pool at each frame,
+  // the command buffers are allocated with the swapchain and the entities.
+  for (uint32_t i = 0; i < frames_in_flight_; ++i) {
+    frames_.push_back(
+      Frame{
+        {}, {}, {}, {}, {}, fence_pool_.Acquire(), vk::Semaphore(),
+        semaphore_pool_.Acquire(), 0});
+  }
+
+  if (profiler_ || auto_samples_ || dynamic_resolution_) {
+    timestamp_valid_bits_ = vk_ctx_->physical_device.getQueueFamilyProperties()
+      [graphics_queue_family_index].timestampValidBits;
+    timestamp_period_ = vk_ctx_->physical_device.getProperties().limits.timestampPeriod;
+    if (!timestamp_valid_bits_)
+      fprintf(stderr, "Warning: the graphics queue doesn't support timestamps.\n");
+    ReserveTimestamps();
+  }
+
+  for (auto &frame : frames_) {
+    frame.upload_commands = std::move(
+      device->allocateCommandBuffersUnique(
+        vk::CommandBufferAllocateInfo(
+          *command_pool_, vk::CommandBufferLevel::ePrimary, 1)).front());
+  }
+
+  if (capture_) {
+    for (auto &frame : frames_) {
+      frame.capture_commands = std::move(
+        device->allocateCommandBuffersUnique(
+          vk::CommandBufferAllocateInfo(
+            *command_pool_, vk::CommandBufferLevel::ePrimary, 1)).front());
+    }
+    capture_buffers_.resize(capture_->slots());
+    capture_memory_flags_ =
+      vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent;
+    const vk::PhysicalDeviceMemoryProperties memory_properties =
+      vk_ctx_->physical_device.getMemoryProperties();
+    for (uint32_t i = 0; i < memory_properties.memoryTypeCount; ++i) {
+      const vk::MemoryPropertyFlags cached =
+        capture_memory_flags_ | vk::MemoryPropertyFlagBits::eHostCached;
+      if ((memory_properties.memoryTypes[i].propertyFlags & cached) == cached) {
+        capture_memory_flags_ = cached;
+        break;
+      }
+    }
+  }
+
   descriptor_set_layout_ =
     space::core::CreateDescriptorSetLayout(
-      device, { {vk::DescriptorType::eUniformBuffer, 1, vk::ShaderStageFlagBits::eVertex} });
+      device, { {vk::DescriptorType::eUniformBufferDynamic, 1,
+                 vk::ShaderStageFlagBits::eVertex | vk::ShaderStageFlagBits::eFragment} });
+  // The entities push their transform with each draw.
+  const vk::PushConstantRange draw_constants_range = space::DrawConstantsRange();
   pipeline_layout_ =
     device->createPipelineLayoutUnique(
       vk::PipelineLayoutCreateInfo(
-        vk::PipelineLayoutCreateFlags(), 1, &descriptor_set_layout_.get()));
+        vk::PipelineLayoutCreateFlags(), 1, &descriptor_set_layout_.get(),
+        1, &draw_constants_range));
+
+  // Pipelines compiled by the previous runs are reused.
+  pipeline_cache_ = pipeline_cache_path_.empty()
+    ? device->createPipelineCacheUnique(vk::PipelineCacheCreateInfo())
+    : space::core::LoadPipelineCache(vk_ctx_->physical_device, device, pipeline_cache_path_);
+
+  // One slice per frame in flight, each respecting the offset alignment.
+  const vk::DeviceSize alignment =
+    vk_ctx_->physical_device.getProperties().limits.minUniformBufferOffsetAlignment;
+  uniform_slice_size_ = (sizeof(UniformData) + alignment - 1) & ~(alignment - 1);
+  uniform_buffer_data_ = std::make_unique<space::core::BufferData>(
+    vk_ctx_->physical_device, device, uniform_slice_size_ * frames_in_flight_,
+    vk::BufferUsageFlagBits::eUniformBuffer,
+    vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
+    "uniform-buffer");
+  // Coherent memory, keep it mapped for the whole scene lifetime.
+  uniform_mapping_ = static_cast<uint8_t*>(
+    device->mapMemory(*uniform_buffer_data_->deviceMemory, 0, VK_WHOLE_SIZE));
+
+  descriptor_pool_ =
+    space::core::CreateDescriptorPool(device, { {vk::DescriptorType::eUniformBufferDynamic, 1} });
+  descriptor_set_ =
+    std::move(
+      device->allocateDescriptorSetsUnique(
+        vk::DescriptorSetAllocateInfo(*descriptor_pool_, 1, &*descriptor_set_layout_)).front());
 
-  pipeline_cache_ =
-    device->createPipelineCacheUnique(vk::PipelineCacheCreateInfo());
+  // The range is a single slice, the dynamic offset selects which one.
+  vk::DescriptorBufferInfo uniform_buffer_info(
+    *uniform_buffer_data_->buffer, 0, sizeof(UniformData));
+  device->updateDescriptorSets(
+    vk::WriteDescriptorSet(
+      *descriptor_set_, 0, 0, 1, vk::DescriptorType::eUniformBufferDynamic,
+      nullptr, &uniform_buffer_info, nullptr), nullptr);
 
   CreateSwapChainContext();
 }
@@ -74,184 +223,765 @@ void Scene::CreateSwapChainContext() {
   const uint32_t present_queue_family_index = vk_ctx_->present_queue_family_index;
 
   const vk::Extent2D extent = QueryExtent();
-  vk::UniqueCommandBuffer command_buffer =
-    std::move(
-      device->allocateCommandBuffersUnique(
-        vk::CommandBufferAllocateInfo(
-          *command_pool_, vk::CommandBufferLevel::ePrimary, 1)).front());
-
-  // Wait device to be idle before destroying everything
-  if (swap_chain_context_)
-    device->waitIdle();
 
-  space::core::SwapChainData swap_chain_data(
-    physical_device, device, *surface, extent,
-    vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eTransferSrc,
-    swap_chain_context_ ? std::move(swap_chain_context_->swap_chain_data.swap_chain) : vk::UniqueSwapchainKHR(),
-    graphics_queue_family_index, present_queue_family_index);
+  // Either the swapchain images or offscreen ones.
+  std::optional<space::core::SwapChainData> swap_chain_data;
+  std::vector<space::core::ImageData> offscreen_images;
+  std::vector<vk::ImageView> image_views;
+  vk::Format color_format;
+  vk::Extent2D target_extent;
+  vk::ImageLayout final_layout;
+  if (headless_) {
+    // As many images as frames in flight, each frame renders to its own.
+    color_format = vk::Format::eR8G8B8A8Unorm;
+    target_extent = extent;
+    final_layout = vk::ImageLayout::eTransferSrcOptimal;
+    for (uint32_t i = 0; i < frames_in_flight_; ++i) {
+      offscreen_images.emplace_back(
+        physical_device, device, color_format, target_extent, vk::ImageTiling::eOptimal,
+        vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eTransferSrc
+        | vk::ImageUsageFlagBits::eTransferDst,
+        vk::ImageLayout::eUndefined, vk::MemoryPropertyFlagBits::eDeviceLocal,
+        vk::ImageAspectFlagBits::eColor, vk::SampleCountFlagBits::e1, "offscreen-target");
+      image_views.push_back(*offscreen_images.back().image_view);
+    }
+  } else {
+    // The old swapchain stays alive with the old context
+    // until the frames presenting from it are done.
+    const vk::UniqueSwapchainKHR no_swap_chain;
+    swap_chain_data.emplace(
+      physical_device, device, *surface, extent,
+      vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eTransferSrc
+      | (scaled_ ? vk::ImageUsageFlagBits::eTransferDst : vk::ImageUsageFlags()),
+      swap_chain_context_ ? swap_chain_context_->swap_chain_data->swap_chain : no_swap_chain,
+      graphics_queue_family_index, present_queue_family_index,
+      present_mode_, swapchain_images_);
+    color_format = swap_chain_data->color_format;
+    target_extent = swap_chain_data->extent;
+    final_layout = vk::ImageLayout::ePresentSrcKHR;
+    for (const auto &view : swap_chain_data->image_views)
+      image_views.push_back(*view);
+  }
 
-  vk::SampleCountFlagBits msaa = space::core::GetMaxUsableSampleCount(physical_device);
+  // Render to the scaled images instead, they are then blitted.
+  std::vector<space::core::ImageData> scaled_images;
+  if (scaled_) {
+    final_layout = vk::ImageLayout::eTransferSrcOptimal;
+    for (auto &view : image_views) {
+      scaled_images.emplace_back(
+        physical_device, device, color_format, target_extent, vk::ImageTiling::eOptimal,
+        vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eTransferSrc,
+        vk::ImageLayout::eUndefined, vk::MemoryPropertyFlagBits::eDeviceLocal,
+        vk::ImageAspectFlagBits::eColor, vk::SampleCountFlagBits::e1, "scaled-target");
+      view = *scaled_images.back().image_view;
+    }
+  }
 
-  space::core::ImageData color_buffer_data(
-    physical_device, device, swap_chain_data.color_format, extent, vk::ImageTiling::eOptimal,
-    vk::ImageUsageFlagBits::eTransientAttachment
-    | vk::ImageUsageFlagBits::eColorAttachment,
-    vk::ImageLayout::eUndefined,
-    vk::MemoryPropertyFlagBits::eDeviceLocal,
-    vk::ImageAspectFlagBits::eColor,
-    msaa);
+  const vk::SampleCountFlagBits msaa =
+    space::core::GetUsableSampleCount(physical_device, samples_);
+
+  // The multisampled color and the depth only live during the render
+  // pass, on tilers they don't need any memory.
+  const vk::MemoryPropertyFlags transient_memory =
+    vk::MemoryPropertyFlagBits::eDeviceLocal | vk::MemoryPropertyFlagBits::eLazilyAllocated;
+  std::optional<space::core::ImageData> color_buffer_data;
+  if (msaa != vk::SampleCountFlagBits::e1) {
+    color_buffer_data.emplace(
+      physical_device, device, color_format, target_extent,
+      vk::ImageTiling::eOptimal,
+      vk::ImageUsageFlagBits::eTransientAttachment
+      | vk::ImageUsageFlagBits::eColorAttachment,
+      vk::ImageLayout::eUndefined,
+      transient_memory,
+      vk::ImageAspectFlagBits::eColor,
+      msaa, "msaa-color");
+  }
 
   space::core::DepthBufferData depth_buffer_data(
     physical_device, device, vk::Format::eD16Unorm,
-    swap_chain_data.extent, vk::ImageUsageFlagBits::eTransientAttachment, msaa);
+    target_extent, vk::ImageUsageFlagBits::eTransientAttachment, msaa, transient_memory);
+
+  // The render pass, and so the pipelines built against it, only
+  // depends on the formats and the sampling. A resize keeps them.
+  const bool keep_render_pass = swap_chain_context_
+    && swap_chain_context_->color_format == color_format
+    && swap_chain_context_->depth_buffer_data.format == depth_buffer_data.format
+    && swap_chain_context_->samples == msaa;
+  vk::UniqueRenderPass render_pass;
+  if (keep_render_pass) {
+    render_pass = std::move(swap_chain_context_->render_pass);
+  } else {
+    // Entities replace their pipelines while registering again,
+    // they can't be in use. This only happens if the surface
+    // format or the sampling changed.
+    if (swap_chain_context_)
+      device->waitIdle();
+    render_pass =
+      space::core::CreateRenderPass(
+        device, color_format, depth_buffer_data.format,
+        vk::AttachmentLoadOp::eClear, final_layout, msaa);
+  }
 
-  vk::UniqueRenderPass render_pass =
-    space::core::CreateRenderPass(
-      device, swap_chain_data.color_format, depth_buffer_data.format,
-      vk::AttachmentLoadOp::eClear, vk::ImageLayout::ePresentSrcKHR,
-      msaa);
+  if (capture_ && !swap_chain_context_ && !IsCapturable(color_format)) {
+    fprintf(stderr, "Warning: can't capture the %s images.\n", vk::to_string(color_format).c_str());
+  }
 
+  const vk::UniqueImageView no_color_view;
   std::vector<vk::UniqueFramebuffer> framebuffers =
     space::core::CreateFramebuffers(
-      device, render_pass, swap_chain_data.image_views,
-      depth_buffer_data.image_view, color_buffer_data.image_view, swap_chain_data.extent);
-
-  space::core::BufferData uniform_buffer_data(
-    physical_device, device, sizeof(glm::mat4x4),
-    vk::BufferUsageFlagBits::eUniformBuffer);
-
-  vk::UniqueDescriptorPool descriptor_pool =
-    space::core::CreateDescriptorPool(device, { {vk::DescriptorType::eUniformBuffer, 1} });
-  vk::UniqueDescriptorSet descriptor_set =
-    std::move(
-      device->allocateDescriptorSetsUnique(
-        vk::DescriptorSetAllocateInfo(*descriptor_pool, 1, &*descriptor_set_layout_)).front());
-
-  space::core::UpdateDescriptorSets(
-    device, descriptor_set,
-    {{vk::DescriptorType::eUniformBuffer, uniform_buffer_data.buffer, vk::UniqueBufferView()}});
+      device, render_pass, image_views, depth_buffer_data.image_view,
+      color_buffer_data ? color_buffer_data->image_view : no_color_view, target_extent);
 
   struct SwapChainContext *swap_chain_context = new SwapChainContext{
-    std::move(command_buffer), std::move(swap_chain_data), msaa, std::move(color_buffer_data),
-    std::move(depth_buffer_data), std::move(uniform_buffer_data),
-    std::move(render_pass), std::move(framebuffers),
-    std::move(descriptor_pool), std::move(descriptor_set)};
-
+    std::move(swap_chain_data), std::move(offscreen_images), std::move(scaled_images),
+    color_format, target_extent,
+    msaa, std::move(color_buffer_data), std::move(depth_buffer_data),
+    std::move(render_pass), std::move(framebuffers)};
+
+  // The frames in flight might still render to the old swapchain,
+  // the pipelines being compiled might still use its render pass.
+  if (!keep_render_pass)
+    vk_ctx_->pipeline_compiler->WaitIdle();
+  if (swap_chain_context_)
+    deletion_queue_.Retire(frame_serial_, std::move(swap_chain_context_));
   swap_chain_context_.reset(swap_chain_context);
 
-  for (const auto entity : entities_) {
-    entity->Register(vk_ctx_, &pipeline_layout_, &swap_chain_context_->render_pass,
-                     swap_chain_context_->max_sampling, &pipeline_cache_);
+  if (!keep_render_pass) {
+    for (const auto entity : entities_) {
+      entity->Register(vk_ctx_, &pipeline_layout_, &swap_chain_context_->render_pass,
+                       swap_chain_context_->samples, &pipeline_cache_);
+    }
+    pipeline_cache_dirty_ = !entities_.empty();
+    OrderEntityCommands();
   }
+
+  // Everything recorded refers to the old framebuffers and extent.
+  const uint32_t image_count = swap_chain_context_->framebuffers.size();
+  for (auto &frame : frames_) {
+    if (!frame.image_commands.empty())
+      deletion_queue_.Retire(frame_serial_, std::move(frame.image_commands));
+    frame.image_commands =
+      device->allocateCommandBuffersUnique(
+        vk::CommandBufferAllocateInfo(
+          *command_pool_, vk::CommandBufferLevel::ePrimary, image_count));
+    frame.image_commands_valid.assign(image_count, false);
+    std::fill(frame.entity_versions.begin(), frame.entity_versions.end(), 0);
+  }
+  // The new swapchain might need more objects, e.g. more images.
+  steady_state_serial_ = frame_serial_ + frames_in_flight_;
 }
 
 void Scene::AddEntity(space::Entity *entity) {
+  vk::UniqueDevice &device = vk_ctx_->device;
+
   // Initialize entity
   entity->Register(vk_ctx_, &pipeline_layout_, &swap_chain_context_->render_pass,
-                   swap_chain_context_->max_sampling, &pipeline_cache_);
+                   swap_chain_context_->samples, &pipeline_cache_);
+  pipeline_cache_dirty_ = true;
   entities_.push_back(entity);
+  const vk::UniqueCommandPool &command_pool =
+    record_command_pools_[RecordWorker(entities_.size() - 1)];
+
+  for (auto &frame : frames_) {
+    frame.entity_commands.push_back(
+      std::move(
+        device->allocateCommandBuffersUnique(
+          vk::CommandBufferAllocateInfo(
+            *command_pool, vk::CommandBufferLevel::eSecondary, 1)).front()));
+    frame.entity_versions.push_back(0);
+  }
+  OrderEntityCommands();
+
+  if (profiler_) {
+    profiler_series_.gpu_entities.push_back(
+      profiler_->Series("gpu-entity-" + std::to_string(entities_.size() - 1),
+                        Profiler::kGpuTrack));
+  }
+  ReserveTimestamps();
 }
 
-void Scene::SubmitRendering() {
-  const vk::UniqueDevice &device = vk_ctx_->device;
-  const space::core::SwapChainData &swap_chain_data = swap_chain_context_->swap_chain_data;
-  const vk::Queue &graphics_queue = graphics_queue_;
-  const vk::UniqueCommandBuffer &command_buffer = swap_chain_context_->command_buffer;
-  const vk::UniqueRenderPass &render_pass = swap_chain_context_->render_pass;
-  const std::vector<vk::UniqueFramebuffer> &framebuffers = swap_chain_context_->framebuffers;
-  const vk::UniquePipelineLayout &pipeline_layout = pipeline_layout_;
-  const vk::UniqueDescriptorSet &descriptor_set = swap_chain_context_->descriptor_set;
-  const space::core::BufferData &uniform_buffer_data = swap_chain_context_->uniform_buffer_data;
-
-  vk::Extent2D extent = swap_chain_context_->swap_chain_data.extent;
-  const auto aspect_ratio =
-    static_cast<float>(extent.width) / static_cast<float>(extent.height);
-
-  // Update the projection matrices with the current values of camera, model, fov, etc..
-  auto projection_matrices = camera_->GetProjectionMatrices(aspect_ratio);
- 
-  // Update uniform buffer
-  space::core::CopyToDevice(
-    device, uniform_buffer_data.deviceMemory,  projection_matrices.clip
-    * projection_matrices.projection * projection_matrices.view * projection_matrices.model);
-
-  // Get the index of the next available swapchain image:
-  vk::UniqueSemaphore imageAcquiredSemaphore = device->createSemaphoreUnique(vk::SemaphoreCreateInfo());
-
-  bool out_of_date = false;
-  try {
-    vk::ResultValue<uint32_t> res =
-      device->acquireNextImageKHR(
-        swap_chain_data.swap_chain.get(), FENCE_TIMEOUT,
-        imageAcquiredSemaphore.get(), nullptr);
-    if (res.result == vk::Result::eSuboptimalKHR)
-      out_of_date = true;
-    assert(res.value < swap_chain_context_->framebuffers.size());
-    current_buffer_ = res.value;
-  } catch (vk::OutOfDateKHRError &) {
-    out_of_date = true;
+void Scene::OrderEntityCommands() {
+  // Executed with the opaque entities first. Those sharing a
+  // pipeline are next to each other, the transparent ones are
+  // blended in the order they were added.
+  std::vector<size_t> order;
+  for (const bool transparent : {false, true}) {
+    const size_t begin = order.size();
+    for (size_t i = 0; i < entities_.size(); ++i) {
+      if (entities_[i]->Transparent() == transparent)
+        order.push_back(i);
+    }
+    if (!transparent) {
+      std::stable_sort(order.begin() + begin, order.end(), [this](size_t a, size_t b) {
+        return std::less<const void *>()(entities_[a]->PipelineId(), entities_[b]->PipelineId());
+      });
+    }
   }
-  if (out_of_date) {
-    // Re-create the swapchain context.
-    CreateSwapChainContext();
-    // Re-submit rendering
-    return SubmitRendering();
+
+  for (auto &frame : frames_) {
+    frame.entity_command_handles.clear();
+    for (const size_t i : order)
+      frame.entity_command_handles.push_back(*frame.entity_commands[i]);
+    frame.image_commands_valid.assign(frame.image_commands_valid.size(), false);
+  }
+}
+
+void Scene::ReserveTimestamps() {
+  if (!timestamp_valid_bits_) return;
+  if (frames_[0].timestamps && entities_.size() <= timestamp_capacity_) return;
+  timestamp_capacity_ = std::max<uint32_t>(2 * entities_.size(), 8);
+  const uint32_t query_count = 2 + 2 * timestamp_capacity_;
+  timestamp_results_.resize(query_count);
+  for (auto &frame : frames_) {
+    if (frame.timestamps)
+      deletion_queue_.Retire(frame_serial_, std::move(frame.timestamps));
+    frame.timestamps =
+      vk_ctx_->device->createQueryPoolUnique(
+        vk::QueryPoolCreateInfo({}, vk::QueryType::eTimestamp, query_count));
+    frame.timestamps_written = false;
+    // The recorded commands refer to the old pool.
+    std::fill(frame.entity_versions.begin(), frame.entity_versions.end(), 0);
+    frame.image_commands_valid.assign(frame.image_commands_valid.size(), false);
+  }
+}
+
+bool Scene::CollectTimestamps(Frame &frame) {
+  const uint32_t query_count = 2 + 2 * entities_.size();
+  // The frame fence was waited, results are available unless
+  // some queries weren't written.
+  const vk::Result result = vk_ctx_->device->getQueryPoolResults(
+    *frame.timestamps, 0, query_count, query_count * sizeof(uint64_t),
+    timestamp_results_.data(), sizeof(uint64_t), vk::QueryResultFlagBits::e64);
+  if (result != vk::Result::eSuccess) return false;
+
+  const uint64_t mask = timestamp_valid_bits_ >= 64
+    ? ~uint64_t(0) : (uint64_t(1) << timestamp_valid_bits_) - 1;
+  const uint64_t origin = timestamp_results_[0];
+  auto to_ms = [this, mask](uint64_t begin, uint64_t end) {
+    return ((end - begin) & mask) * timestamp_period_ / 1e6;
+  };
+  // GPU and CPU clocks are not correlated, the events are
+  // placed in the trace relative to the submission time.
+  auto start = [&frame, &to_ms, origin](uint64_t timestamp) {
+    return frame.submit_time + std::chrono::duration_cast<Profiler::Clock::duration>(
+      std::chrono::duration<double, std::milli>(to_ms(origin, timestamp)));
+  };
+
+  gpu_frame_time_ = to_ms(timestamp_results_[0], timestamp_results_[1]);
+  if (!profiler_) return true;
+  profiler_->Record(profiler_series_.gpu_render_pass, start(origin), gpu_frame_time_);
+  for (size_t i = 0; i < entities_.size(); ++i) {
+    const uint64_t begin = timestamp_results_[2 + 2 * i];
+    const uint64_t end = timestamp_results_[3 + 2 * i];
+    profiler_->Record(profiler_series_.gpu_entities[i], start(begin), to_ms(begin, end));
   }
+  return true;
+}
+
+bool Scene::AdjustRenderScale() {
+  // The scale moves by steps of kStep, and only once the frames
+  // rendered at the current one had time to be measured.
+  const float kStep = 0.05f;
+  const uint32_t kSettleFrames = 30;
+  render_time_average_ = frames_at_scale_ == 0
+    ? gpu_frame_time_ : 0.9 * render_time_average_ + 0.1 * gpu_frame_time_;
+  if (++frames_at_scale_ < kSettleFrames) return false;
+
+  float scale = render_scale_;
+  if (render_time_average_ > frame_time_budget_ms_) {
+    // The cost is about proportional to the pixels, jump to the
+    // scale fitting the budget with some margin.
+    const float fit = render_scale_
+      * std::sqrt(0.9 * frame_time_budget_ms_ / render_time_average_);
+    scale = std::floor(fit / kStep) * kStep;
+  } else if (render_time_average_ < 0.7 * frame_time_budget_ms_) {
+    // Grow slowly, a step at a time. The gap between the two
+    // thresholds avoids oscillating.
+    scale = render_scale_ + kStep;
+  }
+  scale = std::clamp(scale, min_render_scale_, 1.0f);
+  if (std::fabs(scale - render_scale_) < kStep / 2) return false;
+  render_scale_ = scale;
+  frames_at_scale_ = 0;
+  return true;
+}
+
+vk::Extent2D Scene::RenderExtent() const {
+  const vk::Extent2D &extent = swap_chain_context_->extent;
+  if (!scaled_) return extent;
+  return vk::Extent2D(
+    std::max(1u, static_cast<uint32_t>(extent.width * render_scale_ + 0.5f)),
+    std::max(1u, static_cast<uint32_t>(extent.height * render_scale_ + 0.5f)));
+}
+
+vk::Image Scene::TargetImage(uint32_t image_index) const {
+  return headless_
+    ? *swap_chain_context_->offscreen_images[image_index].image
+    : swap_chain_context_->swap_chain_data->images[image_index];
+}
+
+bool Scene::AdjustSampleCount() {
+  // Decide on the mean of a window of frames, changing the sampling
+  // recreates the render pass and the pipelines.
+  const uint32_t kWindow = 120;
+  auto_samples_time_ += gpu_frame_time_;
+  if (++auto_samples_frames_ < kWindow) return false;
+  const double mean = auto_samples_time_ / auto_samples_frames_;
+  auto_samples_time_ = 0;
+  auto_samples_frames_ = 0;
+
+  const uint32_t current = static_cast<uint32_t>(swap_chain_context_->samples);
+  uint32_t samples = current;
+  // Doubling the samples costs up to twice the fill rate, only go
+  // up with enough headroom so that it doesn't oscillate.
+  if (mean > frame_time_budget_ms_ && current > 1) {
+    samples = current / 2;
+  } else if (mean < 0.4 * frame_time_budget_ms_) {
+    samples = static_cast<uint32_t>(
+      space::core::GetUsableSampleCount(vk_ctx_->physical_device, current * 2));
+  }
+  if (samples == current) return false;
+  fprintf(stdout, "MSAA %ux -> %ux, GPU frame time %.2f ms for a %.2f ms budget.\n",
+          current, samples, mean, frame_time_budget_ms_);
+  samples_ = samples;
+  return true;
+}
+
+void Scene::RecordEntityCommands(Frame &frame, size_t entity_index) {
+  const vk::Extent2D extent = RenderExtent();
+  const vk::UniqueCommandBuffer &command_buffer = frame.entity_commands[entity_index];
+  space::Entity *entity = entities_[entity_index];
+  const uint32_t frame_index = &frame - frames_.data();
+  const uint32_t uniform_offset = static_cast<uint32_t>(frame_index * uniform_slice_size_);
+
+  // Nothing is inherited from the primary buffer but the render pass,
+  // bindings and dynamic states have to be set again.
+  vk::CommandBufferInheritanceInfo inheritance_info(*swap_chain_context_->render_pass, 0);
+  command_buffer->begin(
+    vk::CommandBufferBeginInfo(
+      vk::CommandBufferUsageFlagBits::eRenderPassContinue, &inheritance_info));
+
+  command_buffer->bindDescriptorSets(
+    vk::PipelineBindPoint::eGraphics, pipeline_layout_.get(), 0,
+    descriptor_set_.get(), uniform_offset);
+
+  command_buffer->setViewport(
+    0, vk::Viewport(
+      0.0f, 0.0f,
+      static_cast<float>(extent.width),
+      static_cast<float>(extent.height), 0.0f, 1.0f));
+  command_buffer->setScissor(
+    0, vk::Rect2D(vk::Offset2D(0, 0), extent));
+
+  if (frame.timestamps) {
+    command_buffer->writeTimestamp(
+      vk::PipelineStageFlagBits::eTopOfPipe, *frame.timestamps, 2 + 2 * entity_index);
+  }
+  // Recorded again every frame until the pipelines are compiled.
+  const bool ready = entity->Ready();
+  if (ready)
+    entity->Draw(&command_buffer);
+  if (frame.timestamps) {
+    command_buffer->writeTimestamp(
+      vk::PipelineStageFlagBits::eBottomOfPipe, *frame.timestamps, 3 + 2 * entity_index);
+  }
+
+  command_buffer->end();
+  frame.entity_versions[entity_index] = ready ? entity->version() + 1 : 0;
+}
+
+void Scene::RecordImageCommands(Frame &frame, uint32_t image_index) {
+  const vk::UniqueCommandBuffer &command_buffer = frame.image_commands[image_index];
 
   command_buffer->begin(vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlags()));
+  if (frame.timestamps) {
+    command_buffer->resetQueryPool(*frame.timestamps, 0, 2 + 2 * timestamp_capacity_);
+    command_buffer->writeTimestamp(
+      vk::PipelineStageFlagBits::eTopOfPipe, *frame.timestamps, 0);
+  }
 
+  // Without multisampling there is no resolve attachment.
+  const uint32_t attachments = swap_chain_context_->color_buffer_data ? 3 : 2;
   vk::ClearValue clear_values[3];
   clear_values[0].color =
     vk::ClearColorValue(std::array<float, 4>({ 0.9f, 0.9f, 0.9f, 1.0f }));
   clear_values[1].color =
     vk::ClearColorValue(std::array<float, 4>({ 0.9f, 0.9f, 0.9f, 1.0f }));
-  clear_values[2].depthStencil =
+  clear_values[attachments - 1].depthStencil =
     vk::ClearDepthStencilValue(1.0f, 0);
+  const vk::Extent2D render_extent = RenderExtent();
   vk::RenderPassBeginInfo renderPassBeginInfo(
-    render_pass.get(), framebuffers[current_buffer_].get(),
-    vk::Rect2D(vk::Offset2D(0, 0), swap_chain_data.extent), 3, clear_values);
+    swap_chain_context_->render_pass.get(),
+    swap_chain_context_->framebuffers[image_index].get(),
+    vk::Rect2D(vk::Offset2D(0, 0), render_extent), attachments, clear_values);
 
   command_buffer->beginRenderPass(
-    renderPassBeginInfo, vk::SubpassContents::eInline);
+    renderPassBeginInfo, vk::SubpassContents::eSecondaryCommandBuffers);
+  if (!frame.entity_command_handles.empty())
+    command_buffer->executeCommands(frame.entity_command_handles);
+  command_buffer->endRenderPass();
 
-  command_buffer->bindDescriptorSets(
-    vk::PipelineBindPoint::eGraphics, pipeline_layout.get(), 0, descriptor_set.get(), nullptr);
+  if (scaled_) {
+    // Upscale the rendered part to the whole target, timed with
+    // the render pass as it is part of the frame cost.
+    const vk::Extent2D &extent = swap_chain_context_->extent;
+    const vk::Image source = *swap_chain_context_->scaled_images[image_index].image;
+    const vk::Image target = TargetImage(image_index);
+    const vk::ImageLayout target_layout =
+      headless_ ? vk::ImageLayout::eTransferSrcOptimal : vk::ImageLayout::ePresentSrcKHR;
+    const vk::ImageSubresourceRange range(vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1);
+    const vk::ImageSubresourceLayers layers(vk::ImageAspectFlagBits::eColor, 0, 0, 1);
+
+    const std::array<vk::ImageMemoryBarrier, 2> to_transfer = {
+      // Chained to the layout transition at the end of the render pass.
+      vk::ImageMemoryBarrier(
+        vk::AccessFlagBits::eColorAttachmentWrite, vk::AccessFlagBits::eTransferRead,
+        vk::ImageLayout::eTransferSrcOptimal, vk::ImageLayout::eTransferSrcOptimal,
+        VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, source, range),
+      // The previous content is overwritten. The acquired
+      // semaphore is waited at the transfer stage.
+      vk::ImageMemoryBarrier(
+        {}, vk::AccessFlagBits::eTransferWrite,
+        vk::ImageLayout::eUndefined, vk::ImageLayout::eTransferDstOptimal,
+        VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, target, range) };
+    command_buffer->pipelineBarrier(
+      vk::PipelineStageFlagBits::eAllCommands, vk::PipelineStageFlagBits::eTransfer,
+      {}, nullptr, nullptr, to_transfer);
+
+    const std::array<vk::Offset3D, 2> source_bounds = {
+      vk::Offset3D(0, 0, 0),
+      vk::Offset3D(render_extent.width, render_extent.height, 1) };
+    const std::array<vk::Offset3D, 2> target_bounds = {
+      vk::Offset3D(0, 0, 0), vk::Offset3D(extent.width, extent.height, 1) };
+    command_buffer->blitImage(
+      source, vk::ImageLayout::eTransferSrcOptimal,
+      target, vk::ImageLayout::eTransferDstOptimal,
+      vk::ImageBlit(layers, source_bounds, layers, target_bounds), vk::Filter::eLinear);
+
+    command_buffer->pipelineBarrier(
+      vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eAllCommands,
+      {}, nullptr, nullptr,
+      vk::ImageMemoryBarrier(
+        vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eTransferRead,
+        vk::ImageLayout::eTransferDstOptimal, target_layout,
+        VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, target, range));
+  }
+  if (frame.timestamps) {
+    command_buffer->writeTimestamp(
+      vk::PipelineStageFlagBits::eBottomOfPipe, *frame.timestamps, 1);
+  }
+  command_buffer->end();
 
-  command_buffer->setViewport(
-    0, vk::Viewport(
-      0.0f, 0.0f,
-      static_cast<float>(swap_chain_data.extent.width),
-      static_cast<float>(swap_chain_data.extent.height), 0.0f, 1.0f));
-  command_buffer->setScissor(
-    0, vk::Rect2D(vk::Offset2D(0, 0), swap_chain_data.extent));
+  frame.image_commands_valid[image_index] = true;
+}
 
-  for (const auto entity : entities_) {
-    entity->Draw(&command_buffer);
-  }
+bool Scene::RecordUploadCommands(Frame &frame) {
+  const vk::UniqueCommandBuffer &command_buffer = frame.upload_commands;
+  // Serial of the submission below in SubmitRendering().
+  const uint64_t serial = frame_serial_ + 1;
+  command_buffer->begin(
+    vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+  bool recorded = false;
+  for (const auto entity : entities_)
+    recorded |= entity->Upload(*command_buffer, serial, completed_serial_);
+  command_buffer->end();
+  return recorded;
+}
 
-  command_buffer->endRenderPass();
+bool Scene::RecordCaptureCommands(Frame &frame) {
+  const vk::Format format = swap_chain_context_->color_format;
+  if (!IsCapturable(format)) return false;
+  const bool bgra =
+    format == vk::Format::eB8G8R8A8Unorm || format == vk::Format::eB8G8R8A8Srgb;
+  const int slot = capture_->AcquireSlot();
+  if (slot < 0) return false;
+
+  // The slot is released, the GPU is done with its buffer.
+  const vk::Extent2D extent = swap_chain_context_->extent;
+  CaptureBuffer &capture = capture_buffers_[slot];
+  const vk::DeviceSize size = vk::DeviceSize(extent.width) * extent.height * 4;
+  if (capture.size < size) {
+    capture.buffer = std::make_unique<space::core::BufferData>(
+      vk_ctx_->physical_device, vk_ctx_->device, size,
+      vk::BufferUsageFlagBits::eTransferDst, capture_memory_flags_, "capture");
+    capture.mapping = static_cast<uint8_t*>(
+      vk_ctx_->device->mapMemory(*capture.buffer->deviceMemory, 0, VK_WHOLE_SIZE));
+    capture.size = size;
+  }
+  capture.width = extent.width;
+  capture.height = extent.height;
+  capture.bgra = bgra;
+
+  const vk::Image image = TargetImage(current_buffer_);
+  const vk::ImageLayout layout =
+    headless_ ? vk::ImageLayout::eTransferSrcOptimal : vk::ImageLayout::ePresentSrcKHR;
+  const vk::ImageSubresourceRange range(vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1);
+  const vk::UniqueCommandBuffer &command_buffer = frame.capture_commands;
+
+  command_buffer->begin(
+    vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+  // Chained to the layout transition at the end of the render pass.
+  command_buffer->pipelineBarrier(
+    vk::PipelineStageFlagBits::eAllCommands, vk::PipelineStageFlagBits::eTransfer,
+    {}, nullptr, nullptr,
+    vk::ImageMemoryBarrier(
+      vk::AccessFlagBits::eColorAttachmentWrite | vk::AccessFlagBits::eTransferWrite,
+      vk::AccessFlagBits::eTransferRead, layout, vk::ImageLayout::eTransferSrcOptimal,
+      VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, image, range));
+  command_buffer->copyImageToBuffer(
+    image, vk::ImageLayout::eTransferSrcOptimal, *capture.buffer->buffer,
+    vk::BufferImageCopy(
+      0, 0, 0, vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, 0, 0, 1),
+      vk::Offset3D(0, 0, 0), vk::Extent3D(extent.width, extent.height, 1)));
+  if (!headless_) {
+    // Back to the layout the presentation engine expects.
+    command_buffer->pipelineBarrier(
+      vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eBottomOfPipe,
+      {}, nullptr, nullptr,
+      vk::ImageMemoryBarrier(
+        vk::AccessFlagBits::eTransferRead, {},
+        vk::ImageLayout::eTransferSrcOptimal, layout,
+        VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, image, range));
+  }
+  command_buffer->pipelineBarrier(
+    vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eHost,
+    {}, nullptr,
+    vk::BufferMemoryBarrier(
+      vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eHostRead,
+      VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, *capture.buffer->buffer, 0, size),
+    nullptr);
   command_buffer->end();
 
-  device->resetFences(1, &draw_fence_.get());
-  vk::PipelineStageFlags waitDestinationStageMask(vk::PipelineStageFlagBits::eColorAttachmentOutput);
-  vk::SubmitInfo submitInfo(1, &imageAcquiredSemaphore.get(), &waitDestinationStageMask, 1, &command_buffer.get());
-  graphics_queue.submit(submitInfo, draw_fence_.get());
+  frame.capture_slot = slot;
+  return true;
+}
+
+void Scene::EncodeCapture(Frame &frame) {
+  if (frame.capture_slot < 0) return;
+  const CaptureBuffer &capture = capture_buffers_[frame.capture_slot];
+  capture_->Encode(frame.capture_slot, frame.serial, capture.mapping,
+                   capture.width, capture.height, capture.width * 4, capture.bgra);
+  frame.capture_slot = -1;
+}
+
+void Scene::WaitForFrame() {
+  const Frame &frame = frames_[frame_index_];
+  if (frame.serial)
+    (void) vk_ctx_->device->waitForFences(frame.fence, VK_TRUE, UINT64_MAX);
+}
+
+void Scene::FlushPipelineCache() {
+  if (!pipeline_cache_dirty_ || pipeline_cache_path_.empty() || !pipeline_cache_)
+    return;
+  // Saved once the pipelines being compiled are in.
+  if (vk_ctx_->pipeline_compiler->pending())
+    return;
+  pipeline_cache_dirty_ = false;
+  space::core::SavePipelineCache(vk_ctx_->device, pipeline_cache_, pipeline_cache_path_);
+}
+
+void Scene::SubmitRendering() {
+  // Entities added or registered again since the last frame.
+  FlushPipelineCache();
+
+  const vk::UniqueDevice &device = vk_ctx_->device;
+  const vk::Queue &graphics_queue = graphics_queue_;
+  Frame &frame = frames_[frame_index_];
+  const uint32_t uniform_offset = static_cast<uint32_t>(frame_index_ * uniform_slice_size_);
+
+  // Wait for the GPU to be done with the last submission
+  // of this frame before reusing its resources.
+  if (frame.serial) {
+    {
+      Profiler::Scope scope(profiler_, profiler_series_.frame_wait);
+      (void) device->waitForFences(frame.fence, VK_TRUE, UINT64_MAX);
+    }
+    bool resample = false;
+    if (frame.timestamps_written) {
+      if (CollectTimestamps(frame)) {
+        resample = auto_samples_ && AdjustSampleCount();
+        if (dynamic_resolution_ && AdjustRenderScale()) {
+          // Only the viewports and the render area change.
+          for (auto &other : frames_) {
+            std::fill(other.entity_versions.begin(), other.entity_versions.end(), 0);
+            other.image_commands_valid.assign(other.image_commands_valid.size(), false);
+          }
+        }
+      }
+      frame.timestamps_written = false;
+    }
+    if (capture_)
+      EncodeCapture(frame);
+    // Submissions complete in order on the queue.
+    completed_serial_ = std::max(completed_serial_, frame.serial);
+    deletion_queue_.Collect(completed_serial_);
+    if (frame.image_acquired) {
+      semaphore_pool_.Recycle(frame.image_acquired);
+      frame.image_acquired = vk::Semaphore();
+    }
+    if (resample)
+      CreateSwapChainContext();
+  }
+
+  {
+    Profiler::Scope scope(profiler_, profiler_series_.uniform_upload);
+    vk::Extent2D extent = swap_chain_context_->extent;
+    const auto aspect_ratio =
+      static_cast<float>(extent.width) / static_cast<float>(extent.height);
+
+    // Update the projection matrices with the current values of camera, model, fov, etc..
+    auto projection_matrices = camera_->GetProjectionMatrices(aspect_ratio);
+    camera_version_ = camera_->version();
+
+    // Update this frame slice of the uniform buffer. This is the only
+    // thing the camera changes, the recorded commands stay valid.
+    UniformData uniform_data;
+    uniform_data.mvp = projection_matrices.clip
+      * projection_matrices.projection * projection_matrices.view * projection_matrices.model;
+    uniform_data.inverse_mvp = glm::inverse(uniform_data.mvp);
+    memcpy(uniform_mapping_ + uniform_offset, &uniform_data, sizeof(uniform_data));
+  }
+
+  if (headless_) {
+    // Each frame in flight renders to its own offscreen image.
+    current_buffer_ = frame_index_;
+  } else {
+    // Get the index of the next available swapchain image:
+    const vk::Semaphore image_acquired = semaphore_pool_.Acquire();
+    try {
+      Profiler::Scope scope(profiler_, profiler_series_.acquire);
+      vk::ResultValue<uint32_t> res =
+        device->acquireNextImageKHR(
+          swap_chain_context_->swap_chain_data->swap_chain.get(), UINT64_MAX,
+          image_acquired, nullptr);
+      // The semaphore is signaled, render this frame and
+      // recreate the swapchain after presenting it.
+      if (res.result == vk::Result::eSuboptimalKHR)
+        recreate_swap_chain_ = true;
+      assert(res.value < swap_chain_context_->framebuffers.size());
+      current_buffer_ = res.value;
+    } catch (vk::OutOfDateKHRError &) {
+      // The semaphore wasn't signaled, it can be used again.
+      semaphore_pool_.Recycle(image_acquired);
+      // Re-create the swapchain context.
+      CreateSwapChainContext();
+      // Re-submit rendering
+      return SubmitRendering();
+    }
+    frame.image_acquired = image_acquired;
+  }
+
+  std::optional<Profiler::Scope> record_scope;
+  record_scope.emplace(profiler_, profiler_series_.record);
+  // First, the entities might mark themselves dirty.
+  const bool uploaded = RecordUploadCommands(frame);
+  // Record again only the entities which changed. The primary
+  // buffers referencing them are invalidated as a consequence.
+  bool entity_commands_changed = false;
+  for (size_t i = 0; i < entities_.size(); ++i) {
+    if (frame.entity_versions[i] != entities_[i]->version() + 1) {
+      entity_commands_changed = true;
+      break;
+    }
+  }
+  if (entity_commands_changed) {
+    // Each worker only touches its own entities and pool. The
+    // primary executes them in draw order whichever worker
+    // recorded them.
+    // Capturing no more than two pointers keeps the job within the
+    // small buffer of std::function, recording doesn't allocate.
+    record_scheduler_.RunOnAllWorkers([this, &frame](unsigned worker) {
+      const uint32_t workers = record_command_pools_.size();
+      for (size_t i = worker; i < entities_.size(); i += workers) {
+        if (frame.entity_versions[i] == entities_[i]->version() + 1) continue;
+        RecordEntityCommands(frame, i);
+      }
+    });
+    frame.image_commands_valid.assign(frame.image_commands_valid.size(), false);
+  }
+  if (!frame.image_commands_valid[current_buffer_])
+    RecordImageCommands(frame, current_buffer_);
+  // The image commands are reused, the copy is recorded apart.
+  const bool captured = capture_ && RecordCaptureCommands(frame);
+  record_scope.reset();
+
+  Profiler::Scope submit_scope(profiler_, profiler_series_.submit);
+  if (frame.serial)
+    device->resetFences(frame.fence);
+  // When scaled the image is first written by the blit.
+  vk::PipelineStageFlags waitDestinationStageMask(
+    scaled_ ? vk::PipelineStageFlagBits::eTransfer
+    : vk::PipelineStageFlagBits::eColorAttachmentOutput);
+  const vk::CommandBuffer command_buffers[3] = {
+    *frame.upload_commands, *frame.image_commands[current_buffer_], *frame.capture_commands };
+  // Nothing to wait for nor to present when rendering offscreen.
+  vk::SubmitInfo submitInfo(
+    headless_ ? 0 : 1, &frame.image_acquired, &waitDestinationStageMask,
+    1 + uploaded + captured, uploaded ? command_buffers : command_buffers + 1,
+    headless_ ? 0 : 1, &frame.render_finished);
+  graphics_queue.submit(submitInfo, frame.fence);
+  frame.serial = ++frame_serial_;
+  if (frame.timestamps) {
+    frame.timestamps_written = true;
+    frame.submit_time = Profiler::Clock::now();
+  }
+  dirty_ = false;
+
+  // Once every frame has been submitted, rendering must
+  // only use recycled synchronization objects.
+  if (frame_serial_ == steady_state_serial_) {
+    steady_state_sync_objects_ = sync_objects_created();
+  } else if (frame_serial_ > steady_state_serial_
+             && sync_objects_created() != steady_state_sync_objects_) {
+    if (!sync_object_regressions_) {
+      fprintf(stderr, "Synchronization objects created at frame %llu, %zu instead of %zu.\n",
+              (unsigned long long) frame_serial_, sync_objects_created(),
+              steady_state_sync_objects_);
+    }
+    sync_object_regressions_++;
+    steady_state_sync_objects_ = sync_objects_created();
+  }
+}
+
+bool Scene::NeedsRedraw() const {
+  if (dirty_ || frame_serial_ == 0 || camera_->version() != camera_version_)
+    return true;
+  // Present() already moved to the next frame. Recreating the
+  // swapchain resets the versions, forcing a redraw.
+  const Frame &last = frames_[(frame_index_ + frames_in_flight_ - 1) % frames_in_flight_];
+  for (size_t i = 0; i < entities_.size(); ++i) {
+    if (last.entity_versions[i] != entities_[i]->version() + 1)
+      return true;
+  }
+  return false;
 }
 
 void Scene::Present() {
-  vk::UniqueDevice &device = vk_ctx_->device;
-  space::core::SwapChainData &swap_chain_data = swap_chain_context_->swap_chain_data;
+  if (headless_) {
+    frame_index_ = (frame_index_ + 1) % frames_in_flight_;
+    return;
+  }
+  space::core::SwapChainData &swap_chain_data = *swap_chain_context_->swap_chain_data;
   vk::Queue &present_queue = present_queue_;
+  const Frame &frame = frames_[frame_index_];
 
-  while (vk::Result::eTimeout
-         == device->waitForFences(draw_fence_.get(), VK_TRUE, FENCE_TIMEOUT)) { usleep(1000); }
-
+  // The presentation engine waits for the rendering on the GPU,
+  // the CPU can go ahead and prepare the next frame.
   try {
+    Profiler::Scope scope(profiler_, profiler_series_.present);
     auto result = present_queue.presentKHR(
-      vk::PresentInfoKHR(0, nullptr, 1, &swap_chain_data.swap_chain.get(), &current_buffer_));
-    assert(result == vk::Result::eSuccess);
+      vk::PresentInfoKHR(
+        1, &frame.render_finished, 1, &swap_chain_data.swap_chain.get(), &current_buffer_));
+    if (result == vk::Result::eSuboptimalKHR)
+      recreate_swap_chain_ = true;
   } catch (vk::OutOfDateKHRError &) {
+    recreate_swap_chain_ = true;
+  }
+  frame_index_ = (frame_index_ + 1) % frames_in_flight_;
+
+  if (recreate_swap_chain_) {
     // Re-create the swapchain context.
     CreateSwapChainContext();
+    recreate_swap_chain_ = false;
   }
 }
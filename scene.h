@@ -17,30 +17,105 @@
 #define __SIMPLE_SCENE_H_
 
 #include <iostream>
+#include <optional>
 #include <vulkan/vulkan.hpp>
 
+#include "deletion-queue.h"
 #include "vulkan-core.h"
 #include "entity.h"
 #include "input/gamepad.h"
 #include "camera.h"
+#include "frame-capture.h"
+#include "job-scheduler.h"
+#include "profiler.h"
+
+// Tunables of the scene rendering.
+struct SceneConfig {
+  // Number of frames the CPU can prepare while
+  // the GPU is still rendering the previous ones.
+  uint32_t frames_in_flight = 2;
+  // Threads recording the entity command buffers,
+  // 0 for one per hardware thread.
+  uint32_t record_threads = 0;
+  // Unset picks mailbox, then immediate, then fifo.
+  std::optional<vk::PresentModeKHR> present_mode;
+  // Swapchain images, 0 for the minimum the surface supports.
+  uint32_t swapchain_images = 0;
+  // Receives the CPU phases and GPU pass timings if set.
+  Profiler *profiler = nullptr;
+  // Samples per pixel, lowered to what the device supports. 0 picks
+  // them automatically to keep the GPU frame time within the budget.
+  uint32_t samples = 0;
+  double frame_time_budget_ms = 8.0;
+  // Resolution of the rendering relative to the swapchain, the
+  // image is upscaled to it. With dynamic_resolution the scale is
+  // adjusted between min_render_scale and 1 to fit the frame time
+  // budget instead, and automatic samples stay at their initial count.
+  float render_scale = 1.0f;
+  bool dynamic_resolution = false;
+  float min_render_scale = 0.5f;
+  // Copies the rendered frames into its slots to be written
+  // in the background if set.
+  FrameCapture *capture = nullptr;
+  // File the pipeline cache is loaded from and saved to, e.g.
+  // space::core::DefaultPipelineCachePath(). Empty keeps it in memory.
+  std::string pipeline_cache_path;
+};
 
 // Given an initialized vulkan context
 // perform rendering of the entities.
 class Scene {
 public:
   typedef std::function<vk::Extent2D()> QueryExtentCallback;
-  Scene(space::core::VkAppContext *context, Camera *camera, const QueryExtentCallback &fn);
+  Scene(space::core::VkAppContext *context, Camera *camera, const QueryExtentCallback &fn,
+        const SceneConfig &config = SceneConfig());
+  ~Scene();
 
   void Init();
   void AddEntity(space::Entity *entity);
   void SubmitRendering();
   void Present();
 
+  // Block until the GPU is done with the frame about to be prepared
+  // so that SubmitRendering() doesn't have to wait.
+  void WaitForFrame();
+
+  // Force the next frame to be rendered, e.g. the window was exposed.
+  void MarkDirty() { dirty_ = true; }
+  // Whether the last presented frame is out of date: the scene was
+  // marked dirty, the camera moved or an entity changed.
+  bool NeedsRedraw() const;
+
+  // GPU time of the render pass of the last completed frame
+  // in milliseconds, 0 if not measured.
+  double gpu_frame_time() const { return gpu_frame_time_; }
+
+  // Fraction of the swapchain resolution rendered.
+  float render_scale() const { return render_scale_; }
+
+  // Samples per pixel of the color and depth attachments.
+  vk::SampleCountFlagBits sample_count() const { return swap_chain_context_->samples; }
+
+  // Number of synchronization objects ever created.
+  size_t sync_objects_created() const {
+    return semaphore_pool_.created() + fence_pool_.created();
+  }
+  // Frames which created synchronization objects once in steady
+  // state, they should all be recycled. 0 unless there is a leak.
+  uint64_t sync_object_regressions() const { return sync_object_regressions_; }
+  // Whether every frame in flight was submitted since the swapchain
+  // was created. From then on, submitting only reuses resources.
+  bool steady_state() const { return frame_serial_ >= steady_state_serial_; }
+
 private:
   space::core::VkAppContext *const vk_ctx_;
   const QueryExtentCallback QueryExtent;
 
   vk::UniqueCommandPool command_pool_;
+  // Command pools can't be used concurrently, each recording
+  // worker allocates the entity command buffers from its own.
+  JobScheduler record_scheduler_;
+  std::vector<vk::UniqueCommandPool> record_command_pools_;
   vk::Queue graphics_queue_;
   vk::Queue present_queue_;
 
@@ -50,46 +125,220 @@ private:
   // how descriptors should be used.
   vk::UniquePipelineLayout pipeline_layout_;
   vk::UniquePipelineCache pipeline_cache_;
+  const std::string pipeline_cache_path_;
+  // Pipelines were created since the cache was last saved.
+  bool pipeline_cache_dirty_;
+
+  // Number of frames the CPU can prepare while the GPU is still
+  // working on the previous ones.
+  const uint32_t frames_in_flight_;
+  const std::optional<vk::PresentModeKHR> present_mode_;
+  const uint32_t swapchain_images_;
+  // Requested samples per pixel, lowered to what the device supports.
+  uint32_t samples_;
+  const bool auto_samples_;
+  const double frame_time_budget_ms_;
+  // GPU time of the frames rendered since the last adjustment.
+  double auto_samples_time_;
+  uint32_t auto_samples_frames_;
+  // Render at a lower resolution, see SceneConfig.
+  const bool scaled_;
+  const bool dynamic_resolution_;
+  const float min_render_scale_;
+  float render_scale_;
+  // Smoothed GPU frame time and frames rendered since
+  // the last scale change.
+  double render_time_average_;
+  uint32_t frames_at_scale_;
+  // No surface, render to offscreen images instead of a swapchain.
+  const bool headless_;
+  // Index in [0, frames_in_flight_) of the frame being prepared.
+  uint32_t frame_index_;
+
+  // Synchronization objects are recycled, never created or
+  // destroyed while rendering.
+  space::core::SyncObjectPool<vk::Semaphore> semaphore_pool_;
+  space::core::SyncObjectPool<vk::Fence> fence_pool_;
+
+  // Per frame in flight command buffers and synchronization.
+  struct Frame {
+    // Secondary command buffers with the draw commands of each
+    // entity, recorded again only when the entity is marked dirty.
+    std::vector<vk::UniqueCommandBuffer> entity_commands;
+    // In execution order, the opaque entities sorted by pipeline
+    // then the transparent ones in the order they were added.
+    std::vector<vk::CommandBuffer> entity_command_handles;
+    // Entity version recorded plus one, 0 if it must be recorded.
+    std::vector<uint64_t> entity_versions;
+    // Primary command buffers, one per swapchain image, running the
+    // render pass with the entity commands. Recorded again only if
+    // any of them changed or the swapchain was recreated.
+    std::vector<vk::UniqueCommandBuffer> image_commands;
+    std::vector<bool> image_commands_valid;
+    // Signaled when the GPU is done with the frame.
+    vk::Fence fence;
+    // Waited by the last submission of this frame, recycled
+    // once the fence is signaled.
+    vk::Semaphore image_acquired;
+    vk::Semaphore render_finished;
+    // Serial of the last submission, 0 if never submitted.
+    uint64_t serial;
+    // Timestamps of the render pass (0 and 1) and of each
+    // entity i (2 + 2 * i and 3 + 2 * i) when profiling.
+    vk::UniqueQueryPool timestamps;
+    bool timestamps_written = false;
+    Profiler::Clock::time_point submit_time;
+    // Transfers recorded by the entities, submitted
+    // before the image commands.
+    vk::UniqueCommandBuffer upload_commands;
+    // Copies the rendered image into a capture buffer,
+    // submitted after the image commands.
+    vk::UniqueCommandBuffer capture_commands;
+    // Capture slot written by the last submission, -1 if none.
+    int capture_slot = -1;
+  };
+  std::vector<Frame> frames_;
+
+  // Incremented at each submission.
+  uint64_t frame_serial_;
+  // All the submissions up to this serial are done on the GPU.
+  uint64_t completed_serial_;
+  // Resources replaced while the GPU might still use them, freed
+  // once the last frame submitted before replacing them is done.
+  space::core::DeletionQueue deletion_queue_;
+  // Number of synchronization objects once all the frames in flight
+  // have been submitted at least once since the swapchain was created,
+  // which happens at steady_state_serial_.
+  size_t steady_state_sync_objects_;
+  uint64_t steady_state_serial_;
+  uint64_t sync_object_regressions_;
+
+  // Uniform buffer containing the projection matrix and other shared
+  // data. It holds one aligned slice per frame in flight, bound with a
+  // dynamic offset, so that writing the next frame never races with
+  // the GPU reading the previous one.
+  std::unique_ptr<space::core::BufferData> uniform_buffer_data_;
+  vk::DeviceSize uniform_slice_size_;
+  uint8_t *uniform_mapping_;
+  vk::UniqueDescriptorPool descriptor_pool_;
+  vk::UniqueDescriptorSet descriptor_set_;
 
   // Define the set of objects to be recreated
   // in case of an out-of-date swapchain.
   struct SwapChainContext {
-    vk::UniqueCommandBuffer command_buffer;
-    space::core::SwapChainData swap_chain_data;
+    // Unset when rendering offscreen.
+    std::optional<space::core::SwapChainData> swap_chain_data;
+    // Render targets used instead of the swapchain images when
+    // headless, left in the transfer source layout.
+    std::vector<space::core::ImageData> offscreen_images;
+    // When scaled, one per swapchain or offscreen image, rendered to
+    // and upscaled to it. They have the full extent, only the render
+    // extent is used so that the scale changes without reallocating.
+    std::vector<space::core::ImageData> scaled_images;
+    vk::Format color_format;
+    vk::Extent2D extent;
 
-    vk::SampleCountFlagBits max_sampling;
+    vk::SampleCountFlagBits samples;
 
-    // For multisampling
-    space::core::ImageData color_buffer_data;
+    // Multisampled color attachment, resolved into the target.
+    // Unset with a single sample.
+    std::optional<space::core::ImageData> color_buffer_data;
 
     // Depth buffer data. Contains the resulting
     // depth pseudoimage.
     space::core::DepthBufferData depth_buffer_data;
 
-    // Uniform buffer containing projection matrix
-    // and other shared buffers.
-    space::core::BufferData uniform_buffer_data;
-
     // We are using a single render pass
     vk::UniqueRenderPass render_pass;
     std::vector<vk::UniqueFramebuffer> framebuffers;
-    vk::UniqueDescriptorPool descriptor_pool;
-    vk::UniqueDescriptorSet descriptor_set;
   };
 
   std::unique_ptr<SwapChainContext> swap_chain_context_;
 
-  // Creates a new swapchain and returns the old one.
+  // Creates a new swapchain, or the offscreen images when headless,
+  // with its attachments and framebuffers.
+  // The render pass and the entity pipelines are only rebuilt if the
+  // formats or the sampling changed.
   void CreateSwapChainContext();
+  // Save the pipeline cache if new pipelines were added to it.
+  void FlushPipelineCache();
+
+  // Rebuild the execution order of the entity command buffers.
+  void OrderEntityCommands();
+  void RecordEntityCommands(Frame &frame, size_t entity_index);
+  // Entity i is always recorded by worker i % workers so that
+  // its command buffers come from the same pool.
+  uint32_t RecordWorker(size_t entity_index) const {
+    return entity_index % record_command_pools_.size();
+  }
+  void RecordImageCommands(Frame &frame, uint32_t image_index);
+  // Let the entities record their uploads for the next
+  // submission. Returns false if none did.
+  bool RecordUploadCommands(Frame &frame);
+  // Record the copy of the current image to a free capture
+  // slot. Returns false if the frame is not captured.
+  bool RecordCaptureCommands(Frame &frame);
+  // Hand the capture slot of a completed frame to the encoder.
+  void EncodeCapture(Frame &frame);
+
+  // Grow the timestamp query pools to fit all the entities.
+  void ReserveTimestamps();
+  // Read the timestamps of a completed frame into the profiler
+  // and gpu_frame_time_. Returns false if they were not available.
+  bool CollectTimestamps(Frame &frame);
+
+  // Feed the GPU time of a completed frame to the automatic sample
+  // count. Returns true if the render targets must be recreated.
+  bool AdjustSampleCount();
+  // Same for the render scale. Returns true if it changed.
+  bool AdjustRenderScale();
+  // Part of the render targets rendered to.
+  vk::Extent2D RenderExtent() const;
+  // Swapchain or offscreen image presented.
+  vk::Image TargetImage(uint32_t image_index) const;
 
   uint32_t current_buffer_;
 
-  // Fence for when the rendering is done
-  // and we are ready to present :)
-  vk::UniqueFence draw_fence_;
+  // The swapchain is suboptimal or out of date,
+  // recreate it after presenting the current frame.
+  bool recreate_swap_chain_;
+
+  bool dirty_;
+  // Camera version used by the last submitted frame.
+  uint64_t camera_version_;
 
   std::vector<space::Entity *> entities_;
   Camera *camera_;
+
+  Profiler *const profiler_;
+  struct ProfilerSeries {
+    int frame_wait, uniform_upload, acquire, record, submit, present;
+    int gpu_render_pass;
+    std::vector<int> gpu_entities;
+  } profiler_series_;
+  // Zero if the queue doesn't support timestamps or they are not
+  // needed: neither profiling nor picking the samples automatically.
+  uint32_t timestamp_valid_bits_;
+  // Nanoseconds per timestamp tick.
+  float timestamp_period_;
+  // Number of entities the query pools can hold.
+  uint32_t timestamp_capacity_;
+  std::vector<uint64_t> timestamp_results_;
+  double gpu_frame_time_;
+
+  FrameCapture *const capture_;
+  // Host copy of the rendered image of each capture slot. A slot is
+  // only written again once the encoder has released it.
+  struct CaptureBuffer {
+    std::unique_ptr<space::core::BufferData> buffer;
+    uint8_t *mapping = nullptr;
+    vk::DeviceSize size = 0;
+    uint32_t width = 0, height = 0;
+    bool bgra = false;
+  };
+  std::vector<CaptureBuffer> capture_buffers_;
+  // Cached memory if available, the encoder reads every byte.
+  vk::MemoryPropertyFlags capture_memory_flags_;
 };
 
 #endif // __SIMPLE_SCENE_H_
@@ -15,9 +15,14 @@
 #version 450
 #extension GL_ARB_separate_shader_objects : enable
 
+// Set by the pipeline, black by default.
+layout(constant_id = 0) const float kColorR = 0.0;
+layout(constant_id = 1) const float kColorG = 0.0;
+layout(constant_id = 2) const float kColorB = 0.0;
+layout(constant_id = 3) const float kColorA = 1.0;
+
 layout(location = 0) out vec4 out_color;
 
 void main() {
-  // White curve!
-  out_color = vec4(0.0, 0.0, 0.0, 1);
+  out_color = vec4(kColorR, kColorG, kColorB, kColorA);
 }
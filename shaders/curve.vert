@@ -19,8 +19,14 @@ layout(binding = 0) uniform UniformBufferObject {
   mat4 mvp;
 } ubo;
 
+// See space::DrawConstants.
+layout(push_constant) uniform DrawConstants {
+  mat4 model;
+  vec4 params;
+} draw;
+
 layout(location = 0) in vec3 pos;
 
 void main() {
-  gl_Position = ubo.mvp * vec4(pos, 1.0);
+  gl_Position = ubo.mvp * draw.model * vec4(pos, 1.0);
 }
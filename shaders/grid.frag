@@ -1,30 +1,59 @@
-
 #version 450
 #extension GL_ARB_separate_shader_objects : enable
 
-layout(location = 0) in vec2 uv;
-
-layout(location = 0) out vec4 outColor;
+layout(binding = 0) uniform UniformBufferObject {
+  mat4 mvp;
+  mat4 inverse_mvp;
+} ubo;
+
+layout(location = 0) in vec3 near_point;
+layout(location = 1) in vec3 far_point;
+
+layout(location = 0) out vec4 out_color;
+
+// Set by the pipeline, see ReferenceGridStyle.
+// Finest lines are at least this many pixels apart.
+layout(constant_id = 0) const float kMinCellPixels = 8.0;
+// Width of the lines in pixels.
+layout(constant_id = 1) const float kLineWidth = 1.0;
+layout(constant_id = 2) const float kColorR = 0.6;
+layout(constant_id = 3) const float kColorG = 0.6;
+layout(constant_id = 4) const float kColorB = 0.6;
+layout(constant_id = 5) const float kColorA = 0.8;
+
+// Coverage of the lines every spacing units, kLineWidth pixels wide.
+// derivative is the size of a pixel in plane units.
+float Lines(vec2 coord, vec2 derivative, float spacing) {
+  vec2 pixels = abs(fract(coord / spacing - 0.5) - 0.5) * spacing / derivative;
+  return 1.0 - clamp(min(pixels.x, pixels.y) - 0.5 * (kLineWidth - 1.0), 0.0, 1.0);
+}
 
 void main(void) {
-  float divisions = 50.0;
-  float thickness = 0.04;
-  float delta = 0.05 / 2.0;
-
-  float x = fract(uv.x * divisions);
-  x = min(x, 1.0 - x);
-
-  float xdelta = fwidth(x);
-  x = smoothstep(x - xdelta, x + xdelta, thickness);
-
-  float y = fract(uv.y * divisions);
-  y = min(y, 1.0 - y);
-
-  float ydelta = fwidth(y);
-  y = smoothstep(y - ydelta, y + ydelta, thickness);
-
-  float c =clamp(x + y, 0.0, 1.0);
-
-  if (c < 0.3) discard;
-  outColor = vec4(0.8, 0.8, 0.8, 1.0);
+  // Intersect the view ray with the y = 0 plane. Pixels not
+  // looking at it are left fully transparent, never discarded.
+  vec3 ray = far_point - near_point;
+  float t = -near_point.y / ray.y;
+  bool visible = t > 0.0 && t < 1.0;
+  t = visible ? t : 1.0;
+  vec3 position = near_point + t * ray;
+
+  vec4 clip = ubo.mvp * vec4(position, 1.0);
+  gl_FragDepth = visible ? clip.z / clip.w : 1.0;
+
+  // The spacing is a power of 10 picked from the pixel footprint,
+  // blended with the next level up so lines fade in and out while
+  // zooming. Two levels whatever the distance.
+  vec2 coord = position.xz;
+  vec2 derivative = max(fwidth(coord), vec2(1e-6));
+  float lod = log(length(derivative) * kMinCellPixels) / log(10.0);
+  float spacing = pow(10.0, floor(lod));
+  float alpha = max(Lines(coord, derivative, spacing) * (1.0 - fract(lod)),
+                    Lines(coord, derivative, 10.0 * spacing));
+
+  // Fade at grazing angles, where the lines alias, and
+  // towards the far plane instead of ending abruptly.
+  alpha *= smoothstep(0.0, 0.1, abs(ray.y) / length(ray));
+  alpha *= 1.0 - smoothstep(0.5, 1.0, t);
+
+  out_color = vec4(kColorR, kColorG, kColorB, visible ? kColorA * alpha : 0.0);
 }
@@ -1,64 +0,0 @@
-	// 8.13.3743
-	 #pragma once
-const uint32_t grid_frag[] = {
-	0x07230203,0x00010000,0x00080008,0x00000052,0x00000000,0x00020011,0x00000001,0x0006000b,
-	0x00000001,0x4c534c47,0x6474732e,0x3035342e,0x00000000,0x0003000e,0x00000000,0x00000001,
-	0x0007000f,0x00000004,0x00000004,0x6e69616d,0x00000000,0x00000011,0x0000004f,0x00030010,
-	0x00000004,0x00000007,0x00030003,0x00000002,0x000001c2,0x00090004,0x415f4c47,0x735f4252,
-	0x72617065,0x5f657461,0x64616873,0x6f5f7265,0x63656a62,0x00007374,0x00040005,0x00000004,
-	0x6e69616d,0x00000000,0x00050005,0x00000008,0x69766964,0x6e6f6973,0x00000073,0x00050005,
-	0x0000000a,0x63696874,0x73656e6b,0x00000073,0x00040005,0x0000000c,0x746c6564,0x00000061,
-	0x00030005,0x0000000e,0x00000078,0x00030005,0x00000011,0x00007675,0x00040005,0x0000001f,
-	0x6c656478,0x00006174,0x00030005,0x0000002a,0x00000079,0x00040005,0x00000035,0x6c656479,
-	0x00006174,0x00030005,0x00000040,0x00000063,0x00050005,0x0000004f,0x4374756f,0x726f6c6f,
-	0x00000000,0x00040047,0x00000011,0x0000001e,0x00000000,0x00040047,0x0000004f,0x0000001e,
-	0x00000000,0x00020013,0x00000002,0x00030021,0x00000003,0x00000002,0x00030016,0x00000006,
-	0x00000020,0x00040020,0x00000007,0x00000007,0x00000006,0x0004002b,0x00000006,0x00000009,
-	0x42480000,0x0004002b,0x00000006,0x0000000b,0x3d23d70a,0x0004002b,0x00000006,0x0000000d,
-	0x3ccccccd,0x00040017,0x0000000f,0x00000006,0x00000002,0x00040020,0x00000010,0x00000001,
-	0x0000000f,0x0004003b,0x00000010,0x00000011,0x00000001,0x00040015,0x00000012,0x00000020,
-	0x00000000,0x0004002b,0x00000012,0x00000013,0x00000000,0x00040020,0x00000014,0x00000001,
-	0x00000006,0x0004002b,0x00000006,0x0000001b,0x3f800000,0x0004002b,0x00000012,0x0000002b,
-	0x00000001,0x0004002b,0x00000006,0x00000044,0x00000000,0x0004002b,0x00000006,0x00000047,
-	0x3e99999a,0x00020014,0x00000048,0x00040017,0x0000004d,0x00000006,0x00000004,0x00040020,
-	0x0000004e,0x00000003,0x0000004d,0x0004003b,0x0000004e,0x0000004f,0x00000003,0x0004002b,
-	0x00000006,0x00000050,0x3f4ccccd,0x0007002c,0x0000004d,0x00000051,0x00000050,0x00000050,
-	0x00000050,0x0000001b,0x00050036,0x00000002,0x00000004,0x00000000,0x00000003,0x000200f8,
-	0x00000005,0x0004003b,0x00000007,0x00000008,0x00000007,0x0004003b,0x00000007,0x0000000a,
-	0x00000007,0x0004003b,0x00000007,0x0000000c,0x00000007,0x0004003b,0x00000007,0x0000000e,
-	0x00000007,0x0004003b,0x00000007,0x0000001f,0x00000007,0x0004003b,0x00000007,0x0000002a,
-	0x00000007,0x0004003b,0x00000007,0x00000035,0x00000007,0x0004003b,0x00000007,0x00000040,
-	0x00000007,0x0003003e,0x00000008,0x00000009,0x0003003e,0x0000000a,0x0000000b,0x0003003e,
-	0x0000000c,0x0000000d,0x00050041,0x00000014,0x00000015,0x00000011,0x00000013,0x0004003d,
-	0x00000006,0x00000016,0x00000015,0x0004003d,0x00000006,0x00000017,0x00000008,0x00050085,
-	0x00000006,0x00000018,0x00000016,0x00000017,0x0006000c,0x00000006,0x00000019,0x00000001,
-	0x0000000a,0x00000018,0x0003003e,0x0000000e,0x00000019,0x0004003d,0x00000006,0x0000001a,
-	0x0000000e,0x0004003d,0x00000006,0x0000001c,0x0000000e,0x00050083,0x00000006,0x0000001d,
-	0x0000001b,0x0000001c,0x0007000c,0x00000006,0x0000001e,0x00000001,0x00000025,0x0000001a,
-	0x0000001d,0x0003003e,0x0000000e,0x0000001e,0x0004003d,0x00000006,0x00000020,0x0000000e,
-	0x000400d1,0x00000006,0x00000021,0x00000020,0x0003003e,0x0000001f,0x00000021,0x0004003d,
-	0x00000006,0x00000022,0x0000000e,0x0004003d,0x00000006,0x00000023,0x0000001f,0x00050083,
-	0x00000006,0x00000024,0x00000022,0x00000023,0x0004003d,0x00000006,0x00000025,0x0000000e,
-	0x0004003d,0x00000006,0x00000026,0x0000001f,0x00050081,0x00000006,0x00000027,0x00000025,
-	0x00000026,0x0004003d,0x00000006,0x00000028,0x0000000a,0x0008000c,0x00000006,0x00000029,
-	0x00000001,0x00000031,0x00000024,0x00000027,0x00000028,0x0003003e,0x0000000e,0x00000029,
-	0x00050041,0x00000014,0x0000002c,0x00000011,0x0000002b,0x0004003d,0x00000006,0x0000002d,
-	0x0000002c,0x0004003d,0x00000006,0x0000002e,0x00000008,0x00050085,0x00000006,0x0000002f,
-	0x0000002d,0x0000002e,0x0006000c,0x00000006,0x00000030,0x00000001,0x0000000a,0x0000002f,
-	0x0003003e,0x0000002a,0x00000030,0x0004003d,0x00000006,0x00000031,0x0000002a,0x0004003d,
-	0x00000006,0x00000032,0x0000002a,0x00050083,0x00000006,0x00000033,0x0000001b,0x00000032,
-	0x0007000c,0x00000006,0x00000034,0x00000001,0x00000025,0x00000031,0x00000033,0x0003003e,
-	0x0000002a,0x00000034,0x0004003d,0x00000006,0x00000036,0x0000002a,0x000400d1,0x00000006,
-	0x00000037,0x00000036,0x0003003e,0x00000035,0x00000037,0x0004003d,0x00000006,0x00000038,
-	0x0000002a,0x0004003d,0x00000006,0x00000039,0x00000035,0x00050083,0x00000006,0x0000003a,
-	0x00000038,0x00000039,0x0004003d,0x00000006,0x0000003b,0x0000002a,0x0004003d,0x00000006,
-	0x0000003c,0x00000035,0x00050081,0x00000006,0x0000003d,0x0000003b,0x0000003c,0x0004003d,
-	0x00000006,0x0000003e,0x0000000a,0x0008000c,0x00000006,0x0000003f,0x00000001,0x00000031,
-	0x0000003a,0x0000003d,0x0000003e,0x0003003e,0x0000002a,0x0000003f,0x0004003d,0x00000006,
-	0x00000041,0x0000000e,0x0004003d,0x00000006,0x00000042,0x0000002a,0x00050081,0x00000006,
-	0x00000043,0x00000041,0x00000042,0x0008000c,0x00000006,0x00000045,0x00000001,0x0000002b,
-	0x00000043,0x00000044,0x0000001b,0x0003003e,0x00000040,0x00000045,0x0004003d,0x00000006,
-	0x00000046,0x00000040,0x000500b8,0x00000048,0x00000049,0x00000046,0x00000047,0x000300f7,
-	0x0000004b,0x00000000,0x000400fa,0x00000049,0x0000004a,0x0000004b,0x000200f8,0x0000004a,
-	0x000100fc,0x000200f8,0x0000004b,0x0003003e,0x0000004f,0x00000051,0x000100fd,0x00010038
-};
\ No newline at end of file
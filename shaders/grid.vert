@@ -3,27 +3,29 @@
 
 layout(binding = 0) uniform UniformBufferObject {
   mat4 mvp;
+  mat4 inverse_mvp;
 } ubo;
 
-layout(location = 0) out vec2 uv_out;
+// Where the view ray through the vertex crosses the near and far
+// planes. The depth is constant on each, so they interpolate linearly.
+layout(location = 0) out vec3 near_point;
+layout(location = 1) out vec3 far_point;
 
-vec3 positions[4] = vec3[](
-    vec3(10.0, 0.0, 10.0),
-    vec3(10.0, 0.0, -10.0),
-    vec3(-10.0, 0.0, -10.0),
-    vec3(-10.0, 0.0, 10.0)
+// A single triangle covering the whole viewport.
+vec2 positions[3] = vec2[](
+  vec2(-1.0, -1.0),
+  vec2(3.0, -1.0),
+  vec2(-1.0, 3.0)
 );
 
-const uint indexes[6] = uint[6](0, 1, 2, 0, 2, 3);
-
-vec2 uvs[4] = vec2[](
-  vec2(1.0, 1.0),
-  vec2(1.0, 0.0),
-  vec2(0.0, 0.0),
-  vec2(1.0, 0.0)
-);
+vec3 Unproject(vec2 xy, float depth) {
+  vec4 point = ubo.inverse_mvp * vec4(xy, depth, 1.0);
+  return point.xyz / point.w;
+}
 
 void main() {
-    gl_Position = ubo.mvp * vec4(positions[indexes[gl_VertexIndex]], 1.0);
-    uv_out = uvs[indexes[gl_VertexIndex]];
+  vec2 xy = positions[gl_VertexIndex];
+  near_point = Unproject(xy, 0.0);
+  far_point = Unproject(xy, 1.0);
+  gl_Position = vec4(xy, 0.0, 1.0);
 }
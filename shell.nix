@@ -16,5 +16,6 @@ pkgs.mkShell {
       vulkan-tools
       libevdev
       glm
+      glslang
     ];
 }
@@ -19,12 +19,15 @@
 
 #include <getopt.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 
 #include <X11/Xlib.h>
 #include <X11/keysymdef.h>
 #include <X11/XKBlib.h>
 
+#include <cerrno>
 #include <chrono>
+#include <cstdio>
 #include <iostream>
 #include <memory>
 #include <optional>
@@ -33,13 +36,72 @@
 #include <vulkan/vulkan.hpp>
 
 #include "camera.h"
+#include "cli-util.h"
 #include "curve.h"
+#include "frame-capture.h"
+#include "frame-limiter.h"
+#include "profiler.h"
 #include "input/gamepad.h"
 #include "reference-grid.h"
 #include "scene.h"
 #include "vulkan-core.h"
 #include "interface-manager.h"
 
+static std::optional<vk::PresentModeKHR> ParsePresentMode(const char *name) {
+  const std::string mode(name);
+  if (mode == "fifo") return vk::PresentModeKHR::eFifo;
+  if (mode == "fifo-relaxed") return vk::PresentModeKHR::eFifoRelaxed;
+  if (mode == "mailbox") return vk::PresentModeKHR::eMailbox;
+  if (mode == "immediate") return vk::PresentModeKHR::eImmediate;
+  return {};
+}
+
+// Render a fixed number of frames offscreen, no X11 involved.
+static int RunHeadless(SceneConfig scene_config, vk::Extent2D extent, uint64_t frames,
+                       const std::string &profile_prefix) {
+  const struct space::core::VkAppConfig config = {
+    "Space", "SpaceEngine", {}, {}};
+
+  space::core::VkAppContext vk_ctx;
+  if (auto ret = space::core::InitVulkan(config)) {
+    vk_ctx = std::move(ret.value());
+  } else {
+    fprintf(stderr, "Couldn't initialize vulkan.");
+    return 1;
+  }
+
+  {
+    Camera camera;
+    Profiler profiler;
+    scene_config.profiler = &profiler;
+    Scene scene(&vk_ctx, &camera, [extent]() { return extent; }, scene_config);
+
+    ReferenceGrid reference_grid;
+    Curve curve;
+
+    scene.Init();
+    scene.AddEntity(&reference_grid);
+    scene.AddEntity(&curve);
+    // Every rendered frame shows the whole scene.
+    vk_ctx.pipeline_compiler->WaitIdle();
+
+    const auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < frames; ++i) {
+      scene.SubmitRendering();
+      scene.Present();
+    }
+    vk_ctx.device->waitIdle();
+    const double elapsed = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+    fprintf(stdout, "Rendered %llu frames of %ux%u in %.3f s (%.1f fps).\n",
+            (unsigned long long) frames, extent.width, extent.height, elapsed, frames / elapsed);
+
+    if (!profile_prefix.empty())
+      profiler.Export(profile_prefix);
+  }
+  return 0;
+}
+
 static int usage(const char *prog, const char *msg) {
   if (msg) {
     fprintf(stderr, "\033[1m\033[31m%s\033[0m\n\n", msg);
@@ -48,21 +110,101 @@ static int usage(const char *prog, const char *msg) {
           "Options:\n", prog);
   fprintf(stderr,
           "\t    --gamepad <path>     : Use a gamepad as external controller.\n"
+          "\t    --memory-log <secs>  : Print the video memory usage every <secs> seconds.\n"
+          "\t    --frames-in-flight <n> : Frames prepared ahead of the GPU (1-3, default 2).\n"
+          "\t    --record-threads <n> : Threads recording the draw commands (default: one per core).\n"
+          "\t    --on-demand          : Render only when something changed, sleep otherwise.\n"
+          "\t    --present-mode <mode> : fifo, fifo-relaxed, mailbox or immediate.\n"
+          "\t    --swapchain-images <n> : Number of swapchain images (default: surface minimum).\n"
+          "\t    --msaa <samples>     : Samples per pixel, or auto to fit the frame\n"
+          "\t                           budget (default auto).\n"
+          "\t    --frame-budget <ms>  : GPU time per frame for --msaa auto and\n"
+          "\t                           --dynamic-resolution (default 8).\n"
+          "\t    --render-scale <s>   : Render at a fraction of the window resolution.\n"
+          "\t    --dynamic-resolution : Lower the resolution to fit the frame budget.\n"
+          "\t    --min-render-scale <s> : Lowest dynamic resolution scale (default 0.5).\n"
+          "\t    --fps-cap <fps>      : Limit the frame rate.\n"
+          "\t    --low-latency        : Wait for the GPU before sampling the input.\n"
+          "\t    --profile <prefix>   : Write the frame timings to <prefix>.csv and\n"
+          "\t                           <prefix>.json (Chrome trace) on exit.\n"
+          "\t                           Press 'p' to write them at any time.\n"
+          "\t    --headless           : Render offscreen without any window.\n"
+          "\t    --frames <n>         : Frames to render when headless (default 100).\n"
+          "\t    --size <w>x<h>       : Image size when headless (default 1024x768).\n"
+          "\t    --capture <dir>      : Write every rendered frame to <dir>.\n"
+          "\t    --capture-format <format> : png, ppm or raw RGBA (default png).\n"
+          "\t    --pipeline-cache <file> : Pipeline cache file (default\n"
+          "\t                           $XDG_CACHE_HOME/space/pipeline-cache.bin).\n"
+          "\t    --no-pipeline-cache  : Compile the pipelines from scratch, don't save them.\n"
           "\t-h, --help               : Display this help text and exit.\n");
   return 1;
 }
 
 int main(int argc, char *argv[]) {
   std::string gamepad_path;
+  double memory_log_interval = 0;
+  SceneConfig scene_config;
+  scene_config.pipeline_cache_path = space::core::DefaultPipelineCachePath();
+  bool on_demand = false;
+  double fps_cap = 0;
+  bool low_latency = false;
+  std::string profile_prefix;
+  bool headless = false;
+  uint64_t headless_frames = 100;
+  vk::Extent2D headless_extent(1024, 768);
+  std::string capture_directory;
+  FrameCapture::Format capture_format = FrameCapture::kPng;
 
   enum LongOptionsOnly {
-    OPT_GAMEPAD = 1000
+    OPT_GAMEPAD = 1000,
+    OPT_MEMORY_LOG,
+    OPT_FRAMES_IN_FLIGHT,
+    OPT_RECORD_THREADS,
+    OPT_ON_DEMAND,
+    OPT_PRESENT_MODE,
+    OPT_SWAPCHAIN_IMAGES,
+    OPT_MSAA,
+    OPT_FRAME_BUDGET,
+    OPT_RENDER_SCALE,
+    OPT_DYNAMIC_RESOLUTION,
+    OPT_MIN_RENDER_SCALE,
+    OPT_FPS_CAP,
+    OPT_LOW_LATENCY,
+    OPT_PROFILE,
+    OPT_HEADLESS,
+    OPT_FRAMES,
+    OPT_SIZE,
+    OPT_CAPTURE,
+    OPT_CAPTURE_FORMAT,
+    OPT_PIPELINE_CACHE,
+    OPT_NO_PIPELINE_CACHE,
   };
 
   static struct option long_options[] = {
-    { "help",    no_argument,       NULL, 'h' },
-    { "gamepad", required_argument, NULL, OPT_GAMEPAD },
-    { 0,         0,                 0,    0  },
+    { "help",       no_argument,       NULL, 'h' },
+    { "gamepad",    required_argument, NULL, OPT_GAMEPAD },
+    { "memory-log", required_argument, NULL, OPT_MEMORY_LOG },
+    { "frames-in-flight", required_argument, NULL, OPT_FRAMES_IN_FLIGHT },
+    { "record-threads", required_argument, NULL, OPT_RECORD_THREADS },
+    { "on-demand",  no_argument,       NULL, OPT_ON_DEMAND },
+    { "present-mode", required_argument, NULL, OPT_PRESENT_MODE },
+    { "swapchain-images", required_argument, NULL, OPT_SWAPCHAIN_IMAGES },
+    { "msaa",       required_argument, NULL, OPT_MSAA },
+    { "frame-budget", required_argument, NULL, OPT_FRAME_BUDGET },
+    { "render-scale", required_argument, NULL, OPT_RENDER_SCALE },
+    { "dynamic-resolution", no_argument, NULL, OPT_DYNAMIC_RESOLUTION },
+    { "min-render-scale", required_argument, NULL, OPT_MIN_RENDER_SCALE },
+    { "fps-cap",    required_argument, NULL, OPT_FPS_CAP },
+    { "low-latency", no_argument,      NULL, OPT_LOW_LATENCY },
+    { "profile",    required_argument, NULL, OPT_PROFILE },
+    { "headless",   no_argument,       NULL, OPT_HEADLESS },
+    { "frames",     required_argument, NULL, OPT_FRAMES },
+    { "size",       required_argument, NULL, OPT_SIZE },
+    { "capture",    required_argument, NULL, OPT_CAPTURE },
+    { "capture-format", required_argument, NULL, OPT_CAPTURE_FORMAT },
+    { "pipeline-cache", required_argument, NULL, OPT_PIPELINE_CACHE },
+    { "no-pipeline-cache", no_argument, NULL, OPT_NO_PIPELINE_CACHE },
+    { 0,            0,                 0,    0  },
   };
 
   int opt;
@@ -73,6 +215,101 @@ int main(int argc, char *argv[]) {
     case OPT_GAMEPAD:
       gamepad_path = std::string(optarg);
       break;
+    case OPT_MEMORY_LOG:
+      memory_log_interval = atof(optarg);
+      if (memory_log_interval <= 0)
+        return usage(argv[0], "Invalid memory log interval.");
+      break;
+    case OPT_FRAMES_IN_FLIGHT:
+      if (auto frames = ParseUnsigned(optarg, 1, 3))
+        scene_config.frames_in_flight = *frames;
+      else
+        return usage(argv[0], "Frames in flight must be between 1 and 3.");
+      break;
+    case OPT_RECORD_THREADS:
+      if (auto threads = ParseUnsigned(optarg, 1, MaxRecordThreads()))
+        scene_config.record_threads = *threads;
+      else
+        return usage(argv[0], "Invalid number of record threads.");
+      break;
+    case OPT_ON_DEMAND:
+      on_demand = true;
+      break;
+    case OPT_PRESENT_MODE:
+      scene_config.present_mode = ParsePresentMode(optarg);
+      if (!scene_config.present_mode)
+        return usage(argv[0], "Invalid present mode.");
+      break;
+    case OPT_SWAPCHAIN_IMAGES:
+      if (auto images = ParseUnsigned(optarg, 1, 16))
+        scene_config.swapchain_images = *images;
+      else
+        return usage(argv[0], "Invalid number of swapchain images, expected 1 to 16.");
+      break;
+    case OPT_MSAA:
+      if (std::string(optarg) == "auto") {
+        scene_config.samples = 0;
+      } else if (auto samples = ParseSampleCount(optarg)) {
+        scene_config.samples = *samples;
+      } else {
+        return usage(argv[0], "Invalid number of samples, expected a power of two or auto.");
+      }
+      break;
+    case OPT_FRAME_BUDGET:
+      scene_config.frame_time_budget_ms = atof(optarg);
+      if (scene_config.frame_time_budget_ms <= 0)
+        return usage(argv[0], "Invalid frame budget.");
+      break;
+    case OPT_RENDER_SCALE:
+      scene_config.render_scale = atof(optarg);
+      if (scene_config.render_scale <= 0 || scene_config.render_scale > 1)
+        return usage(argv[0], "The render scale must be in (0, 1].");
+      break;
+    case OPT_DYNAMIC_RESOLUTION:
+      scene_config.dynamic_resolution = true;
+      break;
+    case OPT_MIN_RENDER_SCALE:
+      scene_config.min_render_scale = atof(optarg);
+      if (scene_config.min_render_scale <= 0 || scene_config.min_render_scale > 1)
+        return usage(argv[0], "The minimum render scale must be in (0, 1].");
+      break;
+    case OPT_FPS_CAP:
+      fps_cap = atof(optarg);
+      if (fps_cap <= 0)
+        return usage(argv[0], "Invalid fps cap.");
+      break;
+    case OPT_LOW_LATENCY:
+      low_latency = true;
+      break;
+    case OPT_PROFILE:
+      profile_prefix = optarg;
+      break;
+    case OPT_HEADLESS:
+      headless = true;
+      break;
+    case OPT_FRAMES:
+      headless_frames = strtoull(optarg, NULL, 10);
+      if (headless_frames == 0)
+        return usage(argv[0], "Invalid number of frames.");
+      break;
+    case OPT_SIZE:
+      if (sscanf(optarg, "%ux%u", &headless_extent.width, &headless_extent.height) != 2
+          || headless_extent.width == 0 || headless_extent.height == 0)
+        return usage(argv[0], "Invalid size, expected <width>x<height>.");
+      break;
+    case OPT_CAPTURE:
+      capture_directory = optarg;
+      break;
+    case OPT_CAPTURE_FORMAT:
+      if (!FrameCapture::ParseFormat(optarg, &capture_format))
+        return usage(argv[0], "Invalid capture format.");
+      break;
+    case OPT_PIPELINE_CACHE:
+      scene_config.pipeline_cache_path = optarg;
+      break;
+    case OPT_NO_PIPELINE_CACHE:
+      scene_config.pipeline_cache_path.clear();
+      break;
     default:
       return usage(argv[0], "Unkown or invalid option.");
     }
@@ -82,6 +319,20 @@ int main(int argc, char *argv[]) {
   std::cout << "Debug mode on" << std::endl;
 #endif
 
+  // Outlives the scene, which hands it the frames.
+  std::unique_ptr<FrameCapture> capture;
+  if (!capture_directory.empty()) {
+    if (mkdir(capture_directory.c_str(), 0755) != 0 && errno != EEXIST) {
+      perror(capture_directory.c_str());
+      return 1;
+    }
+    capture = std::make_unique<FrameCapture>(capture_directory, capture_format);
+    scene_config.capture = capture.get();
+  }
+
+  if (headless)
+    return RunHeadless(scene_config, headless_extent, headless_frames, profile_prefix);
+
   const struct space::core::VkAppConfig config = {
     "Space", "SpaceEngine", {},
     { VK_KHR_SURFACE_EXTENSION_NAME,
@@ -129,7 +380,8 @@ int main(int argc, char *argv[]) {
   XSync(display, False);
 
   XMaskEvent(display, ExposureMask, &event);
-  XSelectInput(display, window, 0);
+  // Exposed or resized windows have to be rendered again.
+  XSelectInput(display, window, ExposureMask | StructureNotifyMask);
 
   auto get_window_extent = [display, window] () {
     XWindowAttributes attrs;
@@ -152,7 +404,12 @@ int main(int argc, char *argv[]) {
   // the display is closed with XCloseDisplay().
   {
     Camera camera;
-    Scene scene(&vk_ctx, &camera, get_window_extent);
+    // Always collecting, exporting is on demand.
+    Profiler profiler;
+    const int input_poll_series = profiler.Series("input-poll");
+    const int update_scene_series = profiler.Series("update-scene");
+    scene_config.profiler = &profiler;
+    Scene scene(&vk_ctx, &camera, get_window_extent, scene_config);
 
     ReferenceGrid reference_grid;
     Curve curve;
@@ -177,6 +434,11 @@ int main(int argc, char *argv[]) {
     using fsec = std::chrono::duration<double, std::chrono::seconds::period>;
     using fmsec = std::chrono::duration<double, std::chrono::milliseconds::period>;
 
+    // The budget is checked at least once per second even if not logged.
+    const fsec memory_check_interval(memory_log_interval > 0 ? memory_log_interval : 1.0);
+    auto last_memory_check = start;
+    FrameLimiter frame_limiter(fps_cap);
+
     for (;;) {
       FD_ZERO(&read_fds);
       FD_SET(x11_fd, &read_fds);
@@ -185,31 +447,77 @@ int main(int argc, char *argv[]) {
 
       timeout.tv_usec = 1000;
       timeout.tv_sec = 0;
-      int fds_ready = select(max_fd, &read_fds, NULL, NULL, &timeout);
+      // Nothing to draw, sleep until some input arrives. Xlib might
+      // have already read events from the socket, check its queue too.
+      const bool idle = on_demand && !interface_manager.Animating()
+        && !scene.NeedsRedraw() && !XPending(display);
+      if (idle && memory_log_interval > 0) {
+        timeout.tv_sec = static_cast<time_t>(memory_log_interval);
+        timeout.tv_usec = (memory_log_interval - timeout.tv_sec) * 1e6;
+      }
+      if (!idle) {
+        frame_limiter.Wait();
+        // Do all the waiting first so that the input
+        // is as recent as possible once the frame is recorded.
+        if (low_latency) {
+          scene.WaitForFrame();
+          timeout.tv_usec = 0;
+        }
+      }
+      const auto poll_start = Profiler::Clock::now();
+      int fds_ready = select(max_fd, &read_fds, NULL, NULL,
+                             idle && memory_log_interval <= 0 ? NULL : &timeout);
 
       if (fds_ready < 0) {
         perror("select() failed");
         return 1;
       }
+      // Don't account the time spent sleeping to animations.
+      if (idle)
+        start = std::chrono::steady_clock::now();
 
       if (gamepad && FD_ISSET(gamepad_fd, &read_fds)) {
         gamepad->ReadEvents();
       }
 
-      if (FD_ISSET(x11_fd, &read_fds)) {
+      if (FD_ISSET(x11_fd, &read_fds) || XEventsQueued(display, QueuedAlready)) {
         while(XPending(display)) {
           XNextEvent(display, &event);
+          if (event.type == Expose || event.type == ConfigureNotify)
+            scene.MarkDirty();
           xinput2.ReadEvents(event);
         }
       }
+      // Sleeping while idle is not polling.
+      if (!idle) {
+        profiler.Record(input_poll_series, poll_start,
+                        fmsec(Profiler::Clock::now() - poll_start).count());
+      }
       if (interface_manager.Exit()) break;
+      if (interface_manager.ExportProfile())
+        profiler.Export(profile_prefix.empty() ? "space-profile" : profile_prefix);
       std::chrono::duration<double> delta = std::chrono::steady_clock::now() - start;
       const double dt = std::chrono::duration_cast<fmsec>(delta).count();
-      interface_manager.UpdateScene(dt / 100);
-      scene.SubmitRendering();
-      scene.Present();
+      {
+        Profiler::Scope scope(&profiler, update_scene_series);
+        interface_manager.UpdateScene(dt / 100);
+      }
+      if (!on_demand || scene.NeedsRedraw()) {
+        scene.SubmitRendering();
+        scene.Present();
+      }
       start = std::chrono::steady_clock::now();
+
+      if (start - last_memory_check >= memory_check_interval) {
+        const auto stats = space::core::GetMemoryStats(vk_ctx);
+        if (memory_log_interval > 0)
+          space::core::PrintMemoryStats(stdout, stats);
+        space::core::CheckMemoryBudget(stats);
+        last_memory_check = start;
+      }
     }
+    if (!profile_prefix.empty())
+      profiler.Export(profile_prefix);
   }
 
   XCloseDisplay(display);
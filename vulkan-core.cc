@@ -29,6 +29,17 @@
 
 VULKAN_HPP_DEFAULT_DISPATCH_LOADER_DYNAMIC_STORAGE;
 
+// Index of the first queue family supporting graphics.
+static std::optional<uint32_t> FindGraphicsQueueFamilyIndex(vk::PhysicalDevice physical_device) {
+  std::vector<vk::QueueFamilyProperties> queue_family_properties =
+    physical_device.getQueueFamilyProperties();
+  for (size_t i = 0; i < queue_family_properties.size(); i++) {
+    if (queue_family_properties[i].queueFlags & vk::QueueFlagBits::eGraphics)
+      return static_cast<uint32_t>(i);
+  }
+  return {};
+}
+
 // Given a physical device search for queues that can both "present" and do "graphics"
 // If possible pick a family that support both.
 std::optional<std::pair<uint32_t, uint32_t>> FindGraphicsAndPresentQueueFamilyIndex(
@@ -313,14 +324,23 @@ namespace space {
       // possibly configurable policy.
       vk::PhysicalDevice physical_device = instance->enumeratePhysicalDevices()[0];
 
-      // Init the surface
-      vk::UniqueSurfaceKHR surface =
-        instance->createXlibSurfaceKHRUnique(
+      // Init the surface, none when rendering offscreen.
+      vk::UniqueSurfaceKHR surface;
+      if (display) {
+        surface = instance->createXlibSurfaceKHRUnique(
           vk::XlibSurfaceCreateInfoKHR(vk::XlibSurfaceCreateFlagsKHR(), display, window));
+      }
 
       // Find devices for present and graphics.
       std::pair<uint32_t, uint32_t> graphics_and_present_queue_family_index;
-      if (const auto o = FindGraphicsAndPresentQueueFamilyIndex(
+      if (!surface) {
+        if (const auto o = FindGraphicsQueueFamilyIndex(physical_device)) {
+          graphics_and_present_queue_family_index = std::make_pair(o.value(), o.value());
+        } else {
+          fprintf(stderr, "Couldn't find a suitable Graphics queue.");
+          return {};
+        }
+      } else if (const auto o = FindGraphicsAndPresentQueueFamilyIndex(
             physical_device, *surface)) {
         graphics_and_present_queue_family_index = o.value();
       } else {
@@ -329,9 +349,20 @@ namespace space {
       }
 
       // Create logical device. This can enable another set of extensions.
-      const std::vector<std::string> device_extensions = {
-        VK_KHR_SWAPCHAIN_EXTENSION_NAME
-      };
+      std::vector<std::string> device_extensions;
+      if (surface)
+        device_extensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+
+      // Optional, used to query the heaps budget and usage.
+      const auto available_device_extensions =
+        physical_device.enumerateDeviceExtensionProperties();
+      const bool has_memory_budget = std::find_if(
+        available_device_extensions.begin(), available_device_extensions.end(),
+        [](vk::ExtensionProperties const& ep) {
+          return std::string(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME) == ep.extensionName;
+        }) != available_device_extensions.end();
+      if (has_memory_budget)
+        device_extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
 
       const auto physical_device_features = physical_device.getFeatures();
       const auto p = physical_device.getProperties();
@@ -348,21 +379,26 @@ namespace space {
         std::move(debug_utils_messenger),
         physical_device,
         graphics_and_present_queue_family_index.first,
-        graphics_and_present_queue_family_index.second};
+        graphics_and_present_queue_family_index.second,
+        has_memory_budget};
     }
 
-    vk::SampleCountFlagBits GetMaxUsableSampleCount(const vk::PhysicalDevice &physical_device) {
-      return vk::SampleCountFlagBits::e4;
+    std::optional<VkAppContext> InitVulkan(const VkAppConfig config) {
+      return InitVulkan(config, nullptr, 0);
+    }
+
+    vk::SampleCountFlagBits GetUsableSampleCount(
+      vk::PhysicalDevice const& physical_device, uint32_t requested) {
       vk::PhysicalDeviceProperties properties = physical_device.getProperties();
-      vk::SampleCountFlags counts = std::min(
-        properties.limits.framebufferColorSampleCounts, properties.limits.framebufferDepthSampleCounts);
-
-      if (counts & vk::SampleCountFlagBits::e64) return vk::SampleCountFlagBits::e64;
-      if (counts & vk::SampleCountFlagBits::e32) return vk::SampleCountFlagBits::e64;
-      if (counts & vk::SampleCountFlagBits::e16) return vk::SampleCountFlagBits::e64;
-      if (counts & vk::SampleCountFlagBits::e8) return vk::SampleCountFlagBits::e64;
-      if (counts & vk::SampleCountFlagBits::e4) return vk::SampleCountFlagBits::e64;
-      if (counts & vk::SampleCountFlagBits::e2) return vk::SampleCountFlagBits::e64;
+      const vk::SampleCountFlags counts =
+        properties.limits.framebufferColorSampleCounts
+        & properties.limits.framebufferDepthSampleCounts;
+
+      // The flag bits are the sample counts.
+      for (uint32_t samples = 64; samples > 1; samples /= 2) {
+        const auto bit = static_cast<vk::SampleCountFlagBits>(samples);
+        if (samples <= requested && (counts & bit)) return bit;
+      }
       return vk::SampleCountFlagBits::e1;
     }
   }
@@ -19,10 +19,20 @@
 #ifndef __SPACE_CORE_H_
 #define __SPACE_CORE_H_
 
-#include <vector>
-#include <optional>
-#include <memory>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <functional>
 #include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
 
 #include <vulkan/vulkan.hpp>
 #include <X11/Xlib.h>
@@ -59,6 +69,86 @@ namespace space {
       std::vector<std::string> instance_extensions;
     };
 
+    // Creates each shader module once and shares it. Modules are
+    // identified by a hash of their SPIR-V and destroyed with the
+    // last handle referencing them. Thread safe.
+    class ShaderLibrary {
+    public:
+      typedef std::shared_ptr<const vk::UniqueShaderModule> Handle;
+
+      // size is in bytes.
+      Handle Get(vk::UniqueDevice const& device, const uint32_t *code, size_t size);
+      template <size_t N>
+      Handle Get(vk::UniqueDevice const& device, const uint32_t (&code)[N]) {
+        return Get(device, code, sizeof(code));
+      }
+
+      // Number of modules alive.
+      size_t size() const;
+
+      // 64 bits FNV-1a of the SPIR-V words.
+      static uint64_t Hash(const uint32_t *code, size_t size);
+
+    private:
+      struct Entry {
+        std::vector<uint32_t> code;
+        std::weak_ptr<const vk::UniqueShaderModule> module;
+      };
+      mutable std::mutex mutex_;
+      std::unordered_map<uint64_t, Entry> modules_;
+    };
+
+    // Compiles pipelines on background threads, one per hardware
+    // thread. Pipeline caches are internally synchronized, the
+    // compilations can share one. Threads are started on first use.
+    // Also a registry of the pipelines, submissions with the key of
+    // one still alive share it instead of compiling another.
+    class PipelineCompiler {
+    public:
+      typedef std::function<vk::UniquePipeline()> Job;
+
+      // A pipeline being compiled, owns it once ready.
+      class Future {
+      public:
+        bool valid() const { return state_ != nullptr; }
+        bool ready() const;
+        void wait() const;
+        // Null until ready, or if the compilation failed.
+        vk::Pipeline get() const;
+        // Same for the futures sharing the pipeline.
+        const void *id() const { return state_.get(); }
+
+      private:
+        friend class PipelineCompiler;
+        struct State;
+        std::shared_ptr<State> state_;
+      };
+
+      explicit PipelineCompiler(unsigned num_threads = 0);
+      ~PipelineCompiler();
+
+      // An empty key is never shared.
+      Future Submit(const Job &job, const std::string &key = std::string());
+      // Jobs not done yet.
+      size_t pending() const;
+      // Block until all the submitted jobs are done.
+      void WaitIdle();
+
+    private:
+      void WorkerLoop();
+
+      const unsigned num_threads_;
+      std::vector<std::thread> threads_;
+
+      mutable std::mutex mutex_;
+      std::condition_variable work_;
+      std::condition_variable idle_;
+      std::deque<std::pair<Job, std::shared_ptr<Future::State>>> queue_;
+      std::unordered_map<std::string, std::weak_ptr<Future::State>> pipelines_;
+      size_t pending_;
+      bool exit_;
+    };
+
     // Holds the vulkan datacstructures
     // used to represent the vulkan implementation,
     // instantiation and configuration. It does not
@@ -73,12 +163,21 @@ namespace space {
       vk::PhysicalDevice physical_device;
       uint32_t graphics_queue_family_index;
       uint32_t present_queue_family_index;
+      // VK_EXT_memory_budget is enabled on the device.
+      bool has_memory_budget;
+      // Last members, released before the device.
+      std::unique_ptr<PipelineCompiler> pipeline_compiler = std::make_unique<PipelineCompiler>();
+      std::unique_ptr<ShaderLibrary> shader_library = std::make_unique<ShaderLibrary>();
     };
 
     // Takes care of the super boring Vulkan bootstraping.
     std::optional<struct VkAppContext> InitVulkan(
       const VkAppConfig config, Display *display, Window window);
 
+    // Same without any surface, for offscreen rendering.
+    // The swapchain extension is not enabled.
+    std::optional<struct VkAppContext> InitVulkan(const VkAppConfig config);
+
     // Vulkan rendering helper routines
     struct SwapChainData {
       SwapChainData(
@@ -88,7 +187,11 @@ namespace space {
         vk::ImageUsageFlags usage,
         vk::UniqueSwapchainKHR const& old_swap_chain,
         uint32_t graphics_family_index,
-        uint32_t present_family_index);
+        uint32_t present_family_index,
+        // Falls back to the best supported mode if unset or unsupported.
+        std::optional<vk::PresentModeKHR> present_mode = {},
+        // Clamped to what the surface supports, 0 for the minimum.
+        uint32_t image_count = 0);
       vk::Format color_format;
       vk::Extent2D extent;
       vk::UniqueSwapchainKHR swap_chain;
@@ -96,6 +199,28 @@ namespace space {
       std::vector<vk::UniqueImageView> image_views;
     };
 
+    // A vk::UniqueDeviceMemory that is accounted in the
+    // memory statistics for as long as it is alive. The
+    // handle can't be freed or released without it.
+    class DeviceMemory {
+    public:
+      DeviceMemory() = default;
+      explicit DeviceMemory(vk::UniqueDeviceMemory &&memory)
+        : memory_(std::move(memory)) {}
+      DeviceMemory(DeviceMemory &&other) = default;
+      DeviceMemory &operator=(DeviceMemory &&other);
+      ~DeviceMemory();
+
+      const vk::DeviceMemory &get() const { return memory_.get(); }
+      const vk::DeviceMemory &operator*() const { return *memory_; }
+      explicit operator bool() const { return static_cast<bool>(memory_); }
+      // Free the memory.
+      void reset();
+
+    private:
+      vk::UniqueDeviceMemory memory_;
+    };
+
     class BufferData {
     public:
       BufferData(
@@ -103,7 +228,8 @@ namespace space {
         vk::UniqueDevice const& device, vk::DeviceSize size,
         vk::BufferUsageFlags usage,
         vk::MemoryPropertyFlags propertyFlags = vk::MemoryPropertyFlagBits::eHostVisible
-        | vk::MemoryPropertyFlagBits::eHostCoherent);
+        | vk::MemoryPropertyFlagBits::eHostCoherent,
+        const char *tag = "buffer");
 
       template <typename DataType>
       void Upload(
@@ -122,7 +248,7 @@ namespace space {
         size_t stride) const;
 
       vk::UniqueBuffer buffer;
-      vk::UniqueDeviceMemory deviceMemory;
+      DeviceMemory deviceMemory;
 
     private:
       // For debugging pourposes only
@@ -133,15 +259,18 @@ namespace space {
       vk::MemoryPropertyFlags m_propertyFlags;
     };
 
+    // memory_properties may include eLazilyAllocated, for transient
+    // attachments, it is ignored if the device has no such memory.
     struct ImageData {
       ImageData(vk::PhysicalDevice const& physical_device, vk::UniqueDevice const& device,
                 vk::Format format, vk::Extent2D const& extent, vk::ImageTiling tiling,
                 vk::ImageUsageFlags usage, vk::ImageLayout initial_layout,
                 vk::MemoryPropertyFlags memory_properties, vk::ImageAspectFlags aspect_mask,
-                vk::SampleCountFlagBits nsamples = vk::SampleCountFlagBits::e1);
+                vk::SampleCountFlagBits nsamples = vk::SampleCountFlagBits::e1,
+                const char *tag = "image");
       vk::Format format;
       vk::UniqueImage image;
-      vk::UniqueDeviceMemory device_memory;
+      DeviceMemory device_memory;
       vk::UniqueImageView image_view;
     };
 
@@ -150,19 +279,68 @@ namespace space {
         vk::PhysicalDevice &physical_device, vk::UniqueDevice & device,
         vk::Format format, vk::Extent2D const& extent,
         vk::ImageUsageFlagBits usage,
-        vk::SampleCountFlagBits nsamples = vk::SampleCountFlagBits::e1)
+        vk::SampleCountFlagBits nsamples = vk::SampleCountFlagBits::e1,
+        vk::MemoryPropertyFlags memory_properties = vk::MemoryPropertyFlagBits::eDeviceLocal)
         : ImageData(
           physical_device, device, format, extent, vk::ImageTiling::eOptimal,
           usage | vk::ImageUsageFlagBits::eDepthStencilAttachment, vk::ImageLayout::eUndefined,
-          vk::MemoryPropertyFlagBits::eDeviceLocal, vk::ImageAspectFlagBits::eDepth,
-          nsamples) {}
+          memory_properties, vk::ImageAspectFlagBits::eDepth,
+          nsamples, "depth-buffer") {}
     };
 
     vk::UniqueCommandPool CreateCommandPool(vk::UniqueDevice &device, uint32_t queue_family_index);
 
+    // Hands out semaphores or fences, recycling the ones given back
+    // instead of creating new ones. Objects are created only when no
+    // recycled one is available, created() counts them so that the
+    // steady state can be checked not to create any.
+    template <typename Handle>
+    class SyncObjectPool {
+      static_assert(std::is_same<Handle, vk::Semaphore>::value
+                    || std::is_same<Handle, vk::Fence>::value,
+                    "Only semaphores and fences can be pooled.");
+    public:
+      explicit SyncObjectPool(vk::UniqueDevice const& device) : device_(&device) {}
+
+      // Fences are returned unsignaled.
+      Handle Acquire() {
+        if (free_.empty()) {
+          if constexpr (std::is_same<Handle, vk::Fence>::value) {
+            objects_.push_back((*device_)->createFenceUnique(vk::FenceCreateInfo()));
+          } else {
+            objects_.push_back((*device_)->createSemaphoreUnique(vk::SemaphoreCreateInfo()));
+          }
+          free_.reserve(objects_.size());
+          return *objects_.back();
+        }
+        Handle handle = free_.back();
+        free_.pop_back();
+        return handle;
+      }
+
+      // The object must not be in use by the GPU anymore. A semaphore
+      // must be unsignaled, a fence is reset here.
+      void Recycle(Handle handle) {
+        if (!handle) return;
+        if constexpr (std::is_same<Handle, vk::Fence>::value) {
+          (*device_)->resetFences(handle);
+        }
+        free_.push_back(handle);
+      }
+
+      size_t created() const { return objects_.size(); }
+
+    private:
+      const vk::UniqueDevice *device_;
+      std::vector<typename std::conditional<
+                    std::is_same<Handle, vk::Fence>::value,
+                    vk::UniqueFence, vk::UniqueSemaphore>::type> objects_;
+      std::vector<Handle> free_;
+    };
+
     template <class T>
     void CopyToDevice(
-      vk::UniqueDevice const& device, vk::UniqueDeviceMemory const& memory,
+      vk::UniqueDevice const& device, DeviceMemory const& memory,
       T const* pData, size_t count, size_t stride = sizeof(T)) {
       assert(sizeof(T) <= stride);
       uint8_t* deviceData = static_cast<uint8_t*>(
@@ -180,7 +358,7 @@ namespace space {
 
     template <class T>
     void CopyToDevice(
-      vk::UniqueDevice const& device, vk::UniqueDeviceMemory const& memory,
+      vk::UniqueDevice const& device, DeviceMemory const& memory,
       T const& data) { CopyToDevice<T>(device, memory, &data, 1); }
 
     template <typename Func>
@@ -207,11 +385,14 @@ namespace space {
       OneTimeSubmit(commandBuffer, queue, func);
     }
 
-    vk::UniqueDeviceMemory AllocateMemory(
+    // Allocate device memory. The allocation is recorded in the
+    // memory statistics under the owner tag until it is freed.
+    DeviceMemory AllocateMemory(
       vk::UniqueDevice const& device,
       vk::PhysicalDeviceMemoryProperties const& memoryProperties,
       vk::MemoryRequirements const& memoryRequirements,
-      vk::MemoryPropertyFlags memoryPropertyFlags);
+      vk::MemoryPropertyFlags memoryPropertyFlags,
+      const char *tag = "untagged");
 
     uint32_t FindMemoryType(
       vk::PhysicalDeviceMemoryProperties const& memoryProperties,
@@ -231,6 +412,8 @@ namespace space {
     vk::UniqueDescriptorPool CreateDescriptorPool(
       vk::UniqueDevice &device, std::vector<vk::DescriptorPoolSize> const& poolSizes);
 
+    // colorImageView is the multisampled attachment, null when the
+    // render pass is not multisampled.
     std::vector<vk::UniqueFramebuffer> CreateFramebuffers(
       vk::UniqueDevice &device, vk::UniqueRenderPass &renderPass,
       std::vector<vk::UniqueImageView> const& imageViews,
@@ -238,9 +421,20 @@ namespace space {
       vk::UniqueImageView const& colorImageView,
       vk::Extent2D const& extent);
 
+    // Same with image views owned elsewhere, e.g. by ImageData.
+    std::vector<vk::UniqueFramebuffer> CreateFramebuffers(
+      vk::UniqueDevice &device, vk::UniqueRenderPass &renderPass,
+      std::vector<vk::ImageView> const& imageViews,
+      vk::UniqueImageView const& depthImageView,
+      vk::UniqueImageView const& colorImageView,
+      vk::Extent2D const& extent);
+
     std::optional<vk::SurfaceFormatKHR> PickSurfaceFormat(
       std::vector<vk::SurfaceFormatKHR> const& formats);
 
+    // With more than one sample the color is rendered to a multisampled
+    // attachment (0) resolved into the target (1), the depth is 2.
+    // Otherwise the color goes directly to the target (0), the depth is 1.
     vk::UniqueRenderPass CreateRenderPass(
       vk::UniqueDevice &device, vk::Format colorFormat, vk::Format depthFormat,
       vk::AttachmentLoadOp loadOp = vk::AttachmentLoadOp::eClear,
@@ -261,12 +455,32 @@ namespace space {
 
       // Has depth
       GraphicsPipelineBuilder& DepthBuffered(const bool value = true);
+      // Whether a depth buffered pipeline writes the depth, it does by default.
+      GraphicsPipelineBuilder& DepthWrite(const bool value = true);
+      // Blend the color over the target using its alpha.
+      GraphicsPipelineBuilder& AlphaBlending(const bool value = true);
 
       // Shaders
       GraphicsPipelineBuilder& AddVertexShader(
         const vk::ShaderModule &shader, const vk::SpecializationInfo *specialization_info = NULL);
       GraphicsPipelineBuilder& AddFragmentShader(
         const vk::ShaderModule &shader, const vk::SpecializationInfo *specialization_info = NULL);
+      // The builder keeps a reference, the module outlives an asynchronous creation.
+      GraphicsPipelineBuilder& AddVertexShader(
+        const ShaderLibrary::Handle &shader, const vk::SpecializationInfo *specialization_info = NULL);
+      GraphicsPipelineBuilder& AddFragmentShader(
+        const ShaderLibrary::Handle &shader, const vk::SpecializationInfo *specialization_info = NULL);
+
+      // Set the specialization constant constant_id of the stage's
+      // shader, it replaces any specialization info given with it.
+      GraphicsPipelineBuilder& AddSpecializationConstant(
+        vk::ShaderStageFlagBits stage, uint32_t constant_id, float value);
+      GraphicsPipelineBuilder& AddSpecializationConstant(
+        vk::ShaderStageFlagBits stage, uint32_t constant_id, int32_t value);
+      GraphicsPipelineBuilder& AddSpecializationConstant(
+        vk::ShaderStageFlagBits stage, uint32_t constant_id, uint32_t value);
+      GraphicsPipelineBuilder& AddSpecializationConstant(
+        vk::ShaderStageFlagBits stage, uint32_t constant_id, bool value);
 
       GraphicsPipelineBuilder& AddVertexInputBindingDescription(
         uint32_t binding, uint32_t stride, vk::VertexInputRate input_rate);
@@ -279,6 +493,15 @@ namespace space {
 
       // Consume the builder and construct the pipeline
       vk::UniquePipeline Create(vk::UniquePipelineCache *pipeline_cache = nullptr);
+      // Same on the compiler threads. The layout and render pass handles
+      // are copied by the constructor, the objects as well as the device,
+      // shaders and cache must stay alive until the pipeline is ready.
+      // Builders with the same Key() get the same pipeline.
+      PipelineCompiler::Future CreateAsync(
+        PipelineCompiler *compiler, vk::UniquePipelineCache *pipeline_cache = nullptr);
+
+      // The whole state of the builder, handles included.
+      std::string Key() const;
 
       ~GraphicsPipelineBuilder();
 
@@ -287,7 +510,80 @@ namespace space {
       std::unique_ptr<Impl> impl_;
     };
 
-    vk::SampleCountFlagBits GetMaxUsableSampleCount(vk::PhysicalDevice const& physical_device);
+    // Default location of the pipeline cache,
+    // $XDG_CACHE_HOME/space/pipeline-cache.bin or ~/.cache/space/...
+    // Empty if neither XDG_CACHE_HOME nor HOME is set.
+    std::string DefaultPipelineCachePath();
+
+    // Create a pipeline cache with the data saved at path. The data is
+    // ignored if missing, corrupted or written by another device or
+    // driver version, the cache then starts empty.
+    vk::UniquePipelineCache LoadPipelineCache(
+      vk::PhysicalDevice const& physical_device, vk::UniqueDevice const& device,
+      const std::string &path);
+
+    // Write the cache data to path, creating its directory. The file
+    // is replaced atomically, a crash never leaves a truncated cache.
+    bool SavePipelineCache(
+      vk::UniqueDevice const& device, vk::UniquePipelineCache const& pipeline_cache,
+      const std::string &path);
+
+    // The highest sample count usable for both color and depth
+    // attachments not above the requested one.
+    vk::SampleCountFlagBits GetUsableSampleCount(
+      vk::PhysicalDevice const& physical_device, uint32_t requested);
+
+    // Snapshot of the device memory usage.
+    struct MemoryStats {
+      struct Heap {
+        vk::MemoryHeapFlags flags;
+        vk::DeviceSize size;
+        // Reported by the driver if VK_EXT_memory_budget is available,
+        // otherwise the heap size and our own allocations.
+        vk::DeviceSize budget;
+        vk::DeviceSize usage;
+        // Memory allocated through AllocateMemory().
+        vk::DeviceSize allocated;
+        uint32_t allocation_count;
+      };
+
+      struct Type {
+        uint32_t heap_index;
+        vk::MemoryPropertyFlags flags;
+        vk::DeviceSize allocated;
+        uint32_t allocation_count;
+      };
+
+      struct Owner {
+        vk::DeviceSize allocated;
+        uint32_t allocation_count;
+      };
+
+      bool has_budget;
+      std::vector<Heap> heaps;
+      std::vector<Type> types;
+      // Indexed by the tag passed to AllocateMemory().
+      std::map<std::string, Owner> owners;
+
+      vk::DeviceSize allocated;
+      vk::DeviceSize peak_allocated;
+      uint64_t total_allocations;
+    };
+
+    MemoryStats GetMemoryStats(VkAppContext const& context);
+
+    // Print a single line summary of the heaps usage.
+    void PrintMemoryStats(FILE *out, MemoryStats const& stats);
+
+    // Called for each heap whose usage crossed the warning threshold.
+    // This is where cached data (e.g. LODs) can be evicted.
+    typedef std::function<
+      void(uint32_t heap_index, vk::DeviceSize usage, vk::DeviceSize budget)> MemoryPressureCallback;
+    void OnMemoryPressure(const MemoryPressureCallback &callback);
+
+    // Warn and notify the memory pressure listeners if any heap uses
+    // more than threshold * budget. Returns true if that's the case.
+    bool CheckMemoryBudget(MemoryStats const& stats, float threshold = 0.9f);
   }
 }
 
@@ -0,0 +1,210 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright(c) Leonardo Romor <leonardo.romor@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+//
+// Device memory allocation and accounting. Every allocation done
+// through AllocateMemory() is recorded here until it is freed so that
+// we can tell who is using the video memory and how close we are
+// to the budget.
+#include <algorithm>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vulkan/vulkan.hpp>
+
+#include "vulkan-core.h"
+
+namespace {
+  struct Allocation {
+    uint32_t heap_index;
+    uint32_t type_index;
+    std::string tag;
+    vk::DeviceSize size;
+  };
+
+  // Process wide as allocations can happen from any thread
+  // and don't have access to the application context.
+  struct MemoryTracker {
+    std::mutex mutex;
+    std::unordered_map<VkDeviceMemory, Allocation> allocations;
+    std::vector<space::core::MemoryPressureCallback> pressure_callbacks;
+    vk::DeviceSize allocated = 0;
+    vk::DeviceSize peak_allocated = 0;
+    uint64_t total_allocations = 0;
+  };
+
+  MemoryTracker &Tracker() {
+    static MemoryTracker tracker;
+    return tracker;
+  }
+
+  void Track(vk::DeviceMemory memory, Allocation allocation) {
+    MemoryTracker &tracker = Tracker();
+    std::lock_guard<std::mutex> lock(tracker.mutex);
+    tracker.allocated += allocation.size;
+    tracker.peak_allocated = std::max(tracker.peak_allocated, tracker.allocated);
+    tracker.total_allocations++;
+    tracker.allocations.emplace(static_cast<VkDeviceMemory>(memory), std::move(allocation));
+  }
+
+  void Untrack(vk::DeviceMemory memory) {
+    MemoryTracker &tracker = Tracker();
+    std::lock_guard<std::mutex> lock(tracker.mutex);
+    auto it = tracker.allocations.find(static_cast<VkDeviceMemory>(memory));
+    if (it == tracker.allocations.end()) return;
+    tracker.allocated -= it->second.size;
+    tracker.allocations.erase(it);
+  }
+
+  inline double MiB(vk::DeviceSize size) { return size / (1024.0 * 1024.0); }
+}
+
+namespace space {
+  namespace core {
+    DeviceMemory &DeviceMemory::operator=(DeviceMemory &&other) {
+      if (this != &other) {
+        reset();
+        memory_ = std::move(other.memory_);
+      }
+      return *this;
+    }
+
+    DeviceMemory::~DeviceMemory() {
+      reset();
+    }
+
+    void DeviceMemory::reset() {
+      if (!memory_) return;
+      Untrack(memory_.get());
+      memory_.reset();
+    }
+
+    DeviceMemory AllocateMemory(
+      vk::UniqueDevice const& device,
+      vk::PhysicalDeviceMemoryProperties const& memory_properties,
+      vk::MemoryRequirements const& memory_requirements,
+      vk::MemoryPropertyFlags memory_property_flags,
+      const char *tag) {
+      uint32_t memory_type_index = FindMemoryType(
+        memory_properties, memory_requirements.memoryTypeBits, memory_property_flags);
+      DeviceMemory memory(
+        device->allocateMemoryUnique(
+          vk::MemoryAllocateInfo(memory_requirements.size, memory_type_index)));
+      Track(memory.get(), Allocation{
+          memory_properties.memoryTypes[memory_type_index].heapIndex,
+          memory_type_index, tag, memory_requirements.size });
+      return memory;
+    }
+
+    MemoryStats GetMemoryStats(VkAppContext const& context) {
+      MemoryStats stats{};
+      stats.has_budget = context.has_memory_budget;
+
+      vk::PhysicalDeviceMemoryProperties memory_properties;
+      vk::PhysicalDeviceMemoryBudgetPropertiesEXT budget_properties;
+      if (context.has_memory_budget) {
+        auto chain = context.physical_device.getMemoryProperties2<
+          vk::PhysicalDeviceMemoryProperties2, vk::PhysicalDeviceMemoryBudgetPropertiesEXT>();
+        memory_properties = chain.get<vk::PhysicalDeviceMemoryProperties2>().memoryProperties;
+        budget_properties = chain.get<vk::PhysicalDeviceMemoryBudgetPropertiesEXT>();
+      } else {
+        memory_properties = context.physical_device.getMemoryProperties();
+      }
+
+      stats.heaps.resize(memory_properties.memoryHeapCount);
+      for (uint32_t i = 0; i < memory_properties.memoryHeapCount; ++i) {
+        MemoryStats::Heap &heap = stats.heaps[i];
+        heap.flags = memory_properties.memoryHeaps[i].flags;
+        heap.size = memory_properties.memoryHeaps[i].size;
+        heap.budget = context.has_memory_budget ? budget_properties.heapBudget[i] : heap.size;
+        heap.usage = context.has_memory_budget ? budget_properties.heapUsage[i] : 0;
+      }
+
+      stats.types.resize(memory_properties.memoryTypeCount);
+      for (uint32_t i = 0; i < memory_properties.memoryTypeCount; ++i) {
+        stats.types[i].heap_index = memory_properties.memoryTypes[i].heapIndex;
+        stats.types[i].flags = memory_properties.memoryTypes[i].propertyFlags;
+      }
+
+      MemoryTracker &tracker = Tracker();
+      {
+        std::lock_guard<std::mutex> lock(tracker.mutex);
+        for (const auto &value : tracker.allocations) {
+          const Allocation &allocation = value.second;
+          MemoryStats::Heap &heap = stats.heaps[allocation.heap_index];
+          heap.allocated += allocation.size;
+          heap.allocation_count++;
+          MemoryStats::Type &type = stats.types[allocation.type_index];
+          type.allocated += allocation.size;
+          type.allocation_count++;
+          MemoryStats::Owner &owner = stats.owners[allocation.tag];
+          owner.allocated += allocation.size;
+          owner.allocation_count++;
+        }
+        stats.allocated = tracker.allocated;
+        stats.peak_allocated = tracker.peak_allocated;
+        stats.total_allocations = tracker.total_allocations;
+      }
+
+      // Without the extension the best guess is what we allocated.
+      if (!context.has_memory_budget) {
+        for (auto &heap : stats.heaps) heap.usage = heap.allocated;
+      }
+      return stats;
+    }
+
+    void PrintMemoryStats(FILE *out, MemoryStats const& stats) {
+      fprintf(out, "memory%s:", stats.has_budget ? "" : " (no budget ext)");
+      for (size_t i = 0; i < stats.heaps.size(); ++i) {
+        const MemoryStats::Heap &heap = stats.heaps[i];
+        fprintf(out, " heap%zu%s %.1f/%.1f MiB (%.0f%%, %u allocs %.1f MiB)",
+                i, (heap.flags & vk::MemoryHeapFlagBits::eDeviceLocal) ? "[local]" : "",
+                MiB(heap.usage), MiB(heap.budget),
+                heap.budget ? 100.0 * heap.usage / heap.budget : 0.0,
+                heap.allocation_count, MiB(heap.allocated));
+      }
+      fprintf(out, " peak %.1f MiB\n", MiB(stats.peak_allocated));
+    }
+
+    void OnMemoryPressure(const MemoryPressureCallback &callback) {
+      MemoryTracker &tracker = Tracker();
+      std::lock_guard<std::mutex> lock(tracker.mutex);
+      tracker.pressure_callbacks.push_back(callback);
+    }
+
+    bool CheckMemoryBudget(MemoryStats const& stats, float threshold) {
+      std::vector<MemoryPressureCallback> callbacks;
+      {
+        MemoryTracker &tracker = Tracker();
+        std::lock_guard<std::mutex> lock(tracker.mutex);
+        callbacks = tracker.pressure_callbacks;
+      }
+
+      bool pressure = false;
+      for (uint32_t i = 0; i < stats.heaps.size(); ++i) {
+        const MemoryStats::Heap &heap = stats.heaps[i];
+        if (heap.budget == 0 || heap.usage < threshold * heap.budget)
+          continue;
+        pressure = true;
+        fprintf(stderr, "Warning: memory heap %u is at %.0f%% of its budget (%.1f/%.1f MiB).\n",
+                i, 100.0 * heap.usage / heap.budget, MiB(heap.usage), MiB(heap.budget));
+        // Callbacks may free memory, don't hold the lock.
+        for (const auto &callback : callbacks)
+          callback(i, heap.usage, heap.budget);
+      }
+      return pressure;
+    }
+  }
+}
@@ -1,5 +1,13 @@
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <unordered_map>
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
 #include <set>
 #include <vulkan/vulkan.hpp>
 
@@ -19,9 +27,14 @@ public:
   void SetPolygonMode(vk::PolygonMode mode);
   void SetFrontFace(vk::FrontFace front_face);
   void DepthBuffered(const bool value) { depth_buffered_ = value; }
+  void DepthWrite(const bool value) { depth_write_ = value; }
+  void AlphaBlending(const bool value) { alpha_blending_ = value; }
   void AddShader(const vk::ShaderModule &shader,
                  const vk::ShaderStageFlagBits &stage,
                  const vk::SpecializationInfo *specialization_info);
+  void KeepShader(const ShaderLibrary::Handle &shader) { shader_handles_.push_back(shader); }
+  void AddSpecializationConstant(
+    vk::ShaderStageFlagBits stage, uint32_t constant_id, const void *data, size_t size);
 
   void AddVertexInputBindingDescription(
     const vk::VertexInputBindingDescription &input_binding);
@@ -31,14 +44,21 @@ public:
   void EnableDynamicState(const vk::DynamicState &state);
 
   vk::UniquePipeline Create(vk::UniquePipelineCache *pipeline_cache);
+  std::string Key() const;
 private:
+  // The shader stages pointing to the specialization constants.
+  std::vector<vk::PipelineShaderStageCreateInfo> Stages() const;
+
   const vk::UniqueDevice *device_;
-  const vk::UniquePipelineLayout *pipeline_layout_;
-  const vk::UniqueRenderPass *render_pass_;
+  // Copied, the owners might move them while compiling asynchronously.
+  const vk::PipelineLayout pipeline_layout_;
+  const vk::RenderPass render_pass_;
   vk::SampleCountFlagBits nsamples_;
 
   // Depth buffered?
   bool depth_buffered_;
+  bool depth_write_;
+  bool alpha_blending_;
 
   vk::PipelineInputAssemblyStateCreateInfo input_assembly_state_;
   vk::PipelineRasterizationStateCreateInfo rasterization_state_;
@@ -46,6 +66,15 @@ private:
   // A unique shader per type.
   std::unordered_map<enum vk::ShaderStageFlagBits,
                      vk::PipelineShaderStageCreateInfo> stages_;
+  std::vector<ShaderLibrary::Handle> shader_handles_;
+
+  // Specialization constants set through the builder, per stage.
+  struct Specialization {
+    std::vector<vk::SpecializationMapEntry> entries;
+    std::vector<uint8_t> data;
+    vk::SpecializationInfo info;
+  };
+  std::map<vk::ShaderStageFlagBits, Specialization> specializations_;
 
   std::unordered_map<uint32_t, vk::VertexInputBindingDescription> input_bindings_;
   std::vector<vk::VertexInputAttributeDescription> input_attributes_;
@@ -59,9 +88,9 @@ GraphicsPipelineBuilder::Impl::Impl(
   const vk::UniquePipelineLayout *pipeline_layout,
   const vk::UniqueRenderPass *render_pass,
   vk::SampleCountFlagBits nsamples)
-  : device_(device), pipeline_layout_(pipeline_layout),
-    render_pass_(render_pass), nsamples_(nsamples),
-    depth_buffered_(false),
+  : device_(device), pipeline_layout_(pipeline_layout->get()),
+    render_pass_(render_pass->get()), nsamples_(nsamples),
+    depth_buffered_(false), depth_write_(true), alpha_blending_(false),
     input_assembly_state_(
       vk::PipelineInputAssemblyStateCreateFlags(),
       vk::PrimitiveTopology::eTriangleList),
@@ -79,6 +108,36 @@ void GraphicsPipelineBuilder::Impl::AddShader(
       shader, "main", specialization_info)});
 }
 
+void GraphicsPipelineBuilder::Impl::AddSpecializationConstant(
+  vk::ShaderStageFlagBits stage, uint32_t constant_id, const void *data, size_t size) {
+  Specialization &specialization = specializations_[stage];
+  auto entry = std::find_if(
+    specialization.entries.begin(), specialization.entries.end(),
+    [constant_id](const auto &entry) { return entry.constantID == constant_id; });
+  if (entry == specialization.entries.end()) {
+    specialization.entries.emplace_back(constant_id, specialization.data.size(), size);
+    specialization.data.resize(specialization.data.size() + size);
+    entry = specialization.entries.end() - 1;
+  }
+  assert(entry->size == size);
+  memcpy(specialization.data.data() + entry->offset, data, size);
+  // The vectors might have moved.
+  specialization.info = vk::SpecializationInfo(
+    specialization.entries.size(), specialization.entries.data(),
+    specialization.data.size(), specialization.data.data());
+}
+
+std::vector<vk::PipelineShaderStageCreateInfo> GraphicsPipelineBuilder::Impl::Stages() const {
+  std::vector<vk::PipelineShaderStageCreateInfo> stages;
+  for (const auto &value : stages_) {
+    stages.push_back(value.second);
+    const auto specialization = specializations_.find(value.first);
+    if (specialization != specializations_.end())
+      stages.back().pSpecializationInfo = &specialization->second.info;
+  }
+  return stages;
+}
+
 void GraphicsPipelineBuilder::Impl::SetPrimitiveTopology(vk::PrimitiveTopology topology) {
   input_assembly_state_.topology = topology;
 }
@@ -111,10 +170,7 @@ void GraphicsPipelineBuilder::Impl::EnableDynamicState(const vk::DynamicState &s
 
 vk::UniquePipeline GraphicsPipelineBuilder::Impl::Create(vk::UniquePipelineCache *pipeline_cache) {
   // Shaders
-  std::vector<vk::PipelineShaderStageCreateInfo> stages;
-  for (const auto &value : stages_) {
-    stages.push_back(value.second);
-  }
+  const std::vector<vk::PipelineShaderStageCreateInfo> stages = Stages();
 
   // Vertex input state
   std::vector<vk::VertexInputBindingDescription> input_bindings;
@@ -138,7 +194,8 @@ vk::UniquePipeline GraphicsPipelineBuilder::Impl::Create(vk::UniquePipelineCache
     vk::StencilOp::eKeep, vk::StencilOp::eKeep, vk::StencilOp::eKeep,
     vk::CompareOp::eAlways);
   vk::PipelineDepthStencilStateCreateInfo depth_stencil_state(
-    vk::PipelineDepthStencilStateCreateFlags(), depth_buffered_, depth_buffered_,
+    vk::PipelineDepthStencilStateCreateFlags(), depth_buffered_,
+    depth_buffered_ && depth_write_,
     vk::CompareOp::eLessOrEqual, false, false, stencil_op_state, stencil_op_state);
 
     vk::ColorComponentFlags color_component_flags(
@@ -150,6 +207,12 @@ vk::UniquePipeline GraphicsPipelineBuilder::Impl::Create(vk::UniquePipelineCache
   vk::PipelineColorBlendAttachmentState pipeline_color_blend_attachment_state(
     false, vk::BlendFactor::eZero, vk::BlendFactor::eZero, vk::BlendOp::eAdd,
     vk::BlendFactor::eZero, vk::BlendFactor::eZero, vk::BlendOp::eAdd, color_component_flags);
+  if (alpha_blending_) {
+    pipeline_color_blend_attachment_state = vk::PipelineColorBlendAttachmentState(
+      true, vk::BlendFactor::eSrcAlpha, vk::BlendFactor::eOneMinusSrcAlpha, vk::BlendOp::eAdd,
+      vk::BlendFactor::eOne, vk::BlendFactor::eOneMinusSrcAlpha, vk::BlendOp::eAdd,
+      color_component_flags);
+  }
   vk::PipelineColorBlendStateCreateInfo color_blend_state(
     vk::PipelineColorBlendStateCreateFlags(), false, vk::LogicOp::eNoOp,
     1, &pipeline_color_blend_attachment_state, { { 1.0f, 1.0f, 1.0f, 1.0f } });
@@ -169,11 +232,80 @@ vk::UniquePipeline GraphicsPipelineBuilder::Impl::Create(vk::UniquePipelineCache
     nullptr, &viewport_state, &rasterization_state_,
     &multisample_state, &depth_stencil_state,
     &color_blend_state, &dynamic_state,
-    pipeline_layout_->get(), render_pass_->get(), 0, nullptr, 0);
+    pipeline_layout_, render_pass_, 0, nullptr, 0);
 
   auto &device = *device_;
   return device->createGraphicsPipelineUnique(
-    pipeline_cache->get(), graphics_pipeline_create_info).value;
+    pipeline_cache ? pipeline_cache->get() : vk::PipelineCache(),
+    graphics_pipeline_create_info).value;
+}
+
+template <class T>
+static void AppendKey(std::string *key, const T &value) {
+  key->append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+std::string GraphicsPipelineBuilder::Impl::Key() const {
+  std::string key;
+  AppendKey(&key, static_cast<VkPipelineLayout>(pipeline_layout_));
+  AppendKey(&key, static_cast<VkRenderPass>(render_pass_));
+  AppendKey(&key, nsamples_);
+  AppendKey(&key, depth_buffered_);
+  AppendKey(&key, depth_write_);
+  AppendKey(&key, alpha_blending_);
+  AppendKey(&key, input_assembly_state_.topology);
+  AppendKey(&key, input_assembly_state_.primitiveRestartEnable);
+  AppendKey(&key, rasterization_state_.polygonMode);
+  AppendKey(&key, rasterization_state_.cullMode);
+  AppendKey(&key, rasterization_state_.frontFace);
+  AppendKey(&key, rasterization_state_.lineWidth);
+
+  // The maps are sorted, their order isn't.
+  std::vector<vk::PipelineShaderStageCreateInfo> stages = Stages();
+  std::sort(stages.begin(), stages.end(), [](const auto &a, const auto &b) {
+    return static_cast<uint32_t>(a.stage) < static_cast<uint32_t>(b.stage);
+  });
+  for (const auto &stage : stages) {
+    AppendKey(&key, stage.stage);
+    AppendKey(&key, static_cast<VkShaderModule>(stage.module));
+    key.append(stage.pName);
+    key.push_back(0);
+    const vk::SpecializationInfo *info = stage.pSpecializationInfo;
+    AppendKey(&key, info ? info->mapEntryCount : 0u);
+    if (!info) continue;
+    for (uint32_t i = 0; i < info->mapEntryCount; ++i) {
+      AppendKey(&key, info->pMapEntries[i].constantID);
+      AppendKey(&key, info->pMapEntries[i].offset);
+      AppendKey(&key, info->pMapEntries[i].size);
+    }
+    AppendKey(&key, info->dataSize);
+    key.append(static_cast<const char *>(info->pData), info->dataSize);
+  }
+
+  std::vector<vk::VertexInputBindingDescription> input_bindings;
+  for (const auto &value : input_bindings_)
+    input_bindings.push_back(value.second);
+  std::sort(input_bindings.begin(), input_bindings.end(), [](const auto &a, const auto &b) {
+    return a.binding < b.binding;
+  });
+  AppendKey(&key, input_bindings.size());
+  for (const auto &binding : input_bindings) {
+    AppendKey(&key, binding.binding);
+    AppendKey(&key, binding.stride);
+    AppendKey(&key, binding.inputRate);
+  }
+  AppendKey(&key, input_attributes_.size());
+  for (const auto &attribute : input_attributes_) {
+    AppendKey(&key, attribute.location);
+    AppendKey(&key, attribute.binding);
+    AppendKey(&key, attribute.format);
+    AppendKey(&key, attribute.offset);
+  }
+
+  AppendKey(&key, dynamic_states_.size());
+  for (const auto state : dynamic_states_)
+    AppendKey(&key, state);
+  return key;
 }
 
 // PIMPL forwards.
@@ -189,6 +321,12 @@ GraphicsPipelineBuilder& GraphicsPipelineBuilder::SetFrontFace(
 GraphicsPipelineBuilder& GraphicsPipelineBuilder::DepthBuffered(const bool value){
   impl_->DepthBuffered(value); return *this; }
 
+GraphicsPipelineBuilder& GraphicsPipelineBuilder::DepthWrite(const bool value){
+  impl_->DepthWrite(value); return *this; }
+
+GraphicsPipelineBuilder& GraphicsPipelineBuilder::AlphaBlending(const bool value){
+  impl_->AlphaBlending(value); return *this; }
+
 GraphicsPipelineBuilder& GraphicsPipelineBuilder::AddFragmentShader(
   const vk::ShaderModule &shader, const vk::SpecializationInfo *specialization_info) {
   impl_->AddShader(shader, vk::ShaderStageFlagBits::eFragment, specialization_info);
@@ -201,6 +339,44 @@ GraphicsPipelineBuilder& GraphicsPipelineBuilder::AddVertexShader(
   return *this;
 }
 
+GraphicsPipelineBuilder& GraphicsPipelineBuilder::AddSpecializationConstant(
+  vk::ShaderStageFlagBits stage, uint32_t constant_id, float value) {
+  impl_->AddSpecializationConstant(stage, constant_id, &value, sizeof(value));
+  return *this;
+}
+
+GraphicsPipelineBuilder& GraphicsPipelineBuilder::AddSpecializationConstant(
+  vk::ShaderStageFlagBits stage, uint32_t constant_id, int32_t value) {
+  impl_->AddSpecializationConstant(stage, constant_id, &value, sizeof(value));
+  return *this;
+}
+
+GraphicsPipelineBuilder& GraphicsPipelineBuilder::AddSpecializationConstant(
+  vk::ShaderStageFlagBits stage, uint32_t constant_id, uint32_t value) {
+  impl_->AddSpecializationConstant(stage, constant_id, &value, sizeof(value));
+  return *this;
+}
+
+GraphicsPipelineBuilder& GraphicsPipelineBuilder::AddSpecializationConstant(
+  vk::ShaderStageFlagBits stage, uint32_t constant_id, bool value) {
+  // Booleans are 32 bits in SPIR-V.
+  const vk::Bool32 bool32 = value ? VK_TRUE : VK_FALSE;
+  impl_->AddSpecializationConstant(stage, constant_id, &bool32, sizeof(bool32));
+  return *this;
+}
+
+GraphicsPipelineBuilder& GraphicsPipelineBuilder::AddFragmentShader(
+  const ShaderLibrary::Handle &shader, const vk::SpecializationInfo *specialization_info) {
+  impl_->KeepShader(shader);
+  return AddFragmentShader(**shader, specialization_info);
+}
+
+GraphicsPipelineBuilder& GraphicsPipelineBuilder::AddVertexShader(
+  const ShaderLibrary::Handle &shader, const vk::SpecializationInfo *specialization_info) {
+  impl_->KeepShader(shader);
+  return AddVertexShader(**shader, specialization_info);
+}
+
 GraphicsPipelineBuilder& GraphicsPipelineBuilder::AddVertexInputBindingDescription(
   uint32_t binding, uint32_t stride, vk::VertexInputRate input_rate) {
   impl_->AddVertexInputBindingDescription({ binding, stride, input_rate });
@@ -224,6 +400,18 @@ vk::UniquePipeline GraphicsPipelineBuilder::Create(
   return impl_->Create(pipeline_cache);
 }
 
+PipelineCompiler::Future GraphicsPipelineBuilder::CreateAsync(
+  PipelineCompiler *compiler, vk::UniquePipelineCache *pipeline_cache) {
+  // The job has to be copyable.
+  std::shared_ptr<Impl> impl(std::move(impl_));
+  return compiler->Submit(
+    [impl, pipeline_cache]() { return impl->Create(pipeline_cache); }, impl->Key());
+}
+
+std::string GraphicsPipelineBuilder::Key() const {
+  return impl_->Key();
+}
+
 GraphicsPipelineBuilder::GraphicsPipelineBuilder(
   const vk::UniqueDevice *device,
   const vk::UniquePipelineLayout *pipeline_layout,
@@ -232,3 +420,257 @@ GraphicsPipelineBuilder::GraphicsPipelineBuilder(
   : impl_(new Impl(device, pipeline_layout, render_pass, nsamples)) {}
 
 GraphicsPipelineBuilder::~GraphicsPipelineBuilder() = default;
+
+namespace space {
+  namespace core {
+    std::string DefaultPipelineCachePath() {
+      const char *cache_home = getenv("XDG_CACHE_HOME");
+      if (cache_home && cache_home[0])
+        return std::string(cache_home) + "/space/pipeline-cache.bin";
+      const char *home = getenv("HOME");
+      if (home && home[0])
+        return std::string(home) + "/.cache/space/pipeline-cache.bin";
+      return "";
+    }
+
+    vk::UniquePipelineCache LoadPipelineCache(
+      vk::PhysicalDevice const& physical_device, vk::UniqueDevice const& device,
+      const std::string &path) {
+      std::vector<uint8_t> data;
+      if (FILE *in = fopen(path.c_str(), "rb")) {
+        uint8_t buffer[65536];
+        size_t read;
+        while ((read = fread(buffer, 1, sizeof(buffer), in)) > 0)
+          data.insert(data.end(), buffer, buffer + read);
+        fclose(in);
+      }
+
+      // Layout of VK_PIPELINE_CACHE_HEADER_VERSION_ONE. Drivers are
+      // supposed to reject foreign data, not all of them do.
+      struct Header {
+        uint32_t size;
+        uint32_t version;
+        uint32_t vendor_id;
+        uint32_t device_id;
+        uint8_t uuid[VK_UUID_SIZE];
+      } header;
+      bool valid = data.size() >= sizeof(header);
+      if (valid) {
+        memcpy(&header, data.data(), sizeof(header));
+        const vk::PhysicalDeviceProperties properties = physical_device.getProperties();
+        valid = header.size >= sizeof(header)
+          && header.version == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+          && header.vendor_id == properties.vendorID
+          && header.device_id == properties.deviceID
+          && memcmp(header.uuid, &properties.pipelineCacheUUID[0], VK_UUID_SIZE) == 0;
+        if (!valid)
+          fprintf(stderr, "Ignoring the pipeline cache %s of another device or driver.\n",
+                  path.c_str());
+      }
+
+      return device->createPipelineCacheUnique(
+        vk::PipelineCacheCreateInfo(
+          vk::PipelineCacheCreateFlags(), valid ? data.size() : 0,
+          valid ? data.data() : nullptr));
+    }
+
+    bool SavePipelineCache(
+      vk::UniqueDevice const& device, vk::UniquePipelineCache const& pipeline_cache,
+      const std::string &path) {
+      const std::vector<uint8_t> data = device->getPipelineCacheData(*pipeline_cache);
+
+      // Create the directory and its parent, e.g. ~/.cache/space.
+      const size_t slash = path.rfind('/');
+      if (slash != std::string::npos && slash > 0) {
+        const std::string directory = path.substr(0, slash);
+        const size_t parent = directory.rfind('/');
+        if (parent != std::string::npos && parent > 0)
+          mkdir(directory.substr(0, parent).c_str(), 0755);
+        if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+          perror(directory.c_str());
+          return false;
+        }
+      }
+
+      // Written next to the destination then renamed over it.
+      const std::string temporary = path + ".tmp." + std::to_string(getpid());
+      FILE *out = fopen(temporary.c_str(), "wb");
+      if (!out) {
+        perror(temporary.c_str());
+        return false;
+      }
+      bool ok = fwrite(data.data(), 1, data.size(), out) == data.size();
+      ok = fflush(out) == 0 && ok;
+      ok = fsync(fileno(out)) == 0 && ok;
+      ok = fclose(out) == 0 && ok;
+      if (!ok || rename(temporary.c_str(), path.c_str()) != 0) {
+        perror(path.c_str());
+        unlink(temporary.c_str());
+        return false;
+      }
+      return true;
+    }
+
+    struct PipelineCompiler::Future::State {
+      std::mutex mutex;
+      std::condition_variable done;
+      std::atomic<bool> ready = false;
+      vk::UniquePipeline pipeline;
+      // Keeps the shader modules referenced by the builder, their
+      // handles can't be reused by other modules while registered.
+      Job job;
+    };
+
+    bool PipelineCompiler::Future::ready() const {
+      return state_ && state_->ready.load(std::memory_order_acquire);
+    }
+
+    void PipelineCompiler::Future::wait() const {
+      if (!state_) return;
+      std::unique_lock<std::mutex> lock(state_->mutex);
+      state_->done.wait(lock, [this]() { return state_->ready.load(); });
+    }
+
+    vk::Pipeline PipelineCompiler::Future::get() const {
+      return ready() ? *state_->pipeline : vk::Pipeline();
+    }
+
+    PipelineCompiler::PipelineCompiler(unsigned num_threads)
+      : num_threads_(num_threads ? num_threads : std::max(1u, std::thread::hardware_concurrency())),
+        pending_(0), exit_(false) {}
+
+    PipelineCompiler::~PipelineCompiler() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        exit_ = true;
+      }
+      work_.notify_all();
+      // The queued jobs are run before the threads exit.
+      for (auto &thread : threads_)
+        thread.join();
+    }
+
+    PipelineCompiler::Future PipelineCompiler::Submit(const Job &job, const std::string &key) {
+      Future future;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!key.empty()) {
+          auto it = pipelines_.find(key);
+          if (it != pipelines_.end() && (future.state_ = it->second.lock()))
+            return future;
+          // Forget the pipelines released since.
+          for (auto it = pipelines_.begin(); it != pipelines_.end();) {
+            if (it->second.expired())
+              it = pipelines_.erase(it);
+            else
+              ++it;
+          }
+        }
+        future.state_ = std::make_shared<Future::State>();
+        if (!key.empty())
+          pipelines_[key] = future.state_;
+        if (threads_.empty()) {
+          for (unsigned i = 0; i < num_threads_; ++i)
+            threads_.emplace_back(&PipelineCompiler::WorkerLoop, this);
+        }
+        queue_.emplace_back(job, future.state_);
+        pending_++;
+      }
+      work_.notify_one();
+      return future;
+    }
+
+    size_t PipelineCompiler::pending() const {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return pending_;
+    }
+
+    void PipelineCompiler::WaitIdle() {
+      std::unique_lock<std::mutex> lock(mutex_);
+      idle_.wait(lock, [this]() { return pending_ == 0; });
+    }
+
+    void PipelineCompiler::WorkerLoop() {
+      std::unique_lock<std::mutex> lock(mutex_);
+      for (;;) {
+        work_.wait(lock, [this]() { return exit_ || !queue_.empty(); });
+        if (queue_.empty())
+          return;
+        auto [job, state] = std::move(queue_.front());
+        queue_.pop_front();
+        lock.unlock();
+
+        vk::UniquePipeline pipeline;
+        try {
+          pipeline = job();
+        } catch (const vk::SystemError &error) {
+          std::cerr << "Pipeline compilation failed: " << error.what() << std::endl;
+        }
+        {
+          std::lock_guard<std::mutex> state_lock(state->mutex);
+          state->pipeline = std::move(pipeline);
+          state->job = std::move(job);
+          state->ready.store(true, std::memory_order_release);
+        }
+        state->done.notify_all();
+        // Released outside the compiler lock, the pipeline might
+        // not be used anymore.
+        state.reset();
+
+        lock.lock();
+        if (--pending_ == 0)
+          idle_.notify_all();
+      }
+    }
+
+    uint64_t ShaderLibrary::Hash(const uint32_t *code, size_t size) {
+      uint64_t hash = 14695981039346656037ull;
+      for (size_t i = 0; i < size / sizeof(uint32_t); ++i) {
+        hash ^= code[i];
+        hash *= 1099511628211ull;
+      }
+      return hash;
+    }
+
+    ShaderLibrary::Handle ShaderLibrary::Get(
+      vk::UniqueDevice const& device, const uint32_t *code, size_t size) {
+      const uint64_t hash = Hash(code, size);
+      std::lock_guard<std::mutex> lock(mutex_);
+      Entry &entry = modules_[hash];
+      const bool same_code = entry.code.size() * sizeof(uint32_t) == size
+        && std::equal(entry.code.begin(), entry.code.end(), code);
+      if (same_code) {
+        if (Handle module = entry.module.lock())
+          return module;
+      } else if (!entry.module.expired()) {
+        // Collision, the module in the library stays.
+        return std::make_shared<const vk::UniqueShaderModule>(
+          device->createShaderModuleUnique(
+            vk::ShaderModuleCreateInfo(vk::ShaderModuleCreateFlags(), size, code)));
+      }
+
+      Handle module = std::make_shared<const vk::UniqueShaderModule>(
+        device->createShaderModuleUnique(
+          vk::ShaderModuleCreateInfo(vk::ShaderModuleCreateFlags(), size, code)));
+      entry.code.assign(code, code + size / sizeof(uint32_t));
+      entry.module = module;
+
+      // Forget the modules released since.
+      for (auto it = modules_.begin(); it != modules_.end();) {
+        if (it->second.module.expired())
+          it = modules_.erase(it);
+        else
+          ++it;
+      }
+      return module;
+    }
+
+    size_t ShaderLibrary::size() const {
+      std::lock_guard<std::mutex> lock(mutex_);
+      size_t alive = 0;
+      for (const auto &module : modules_)
+        alive += !module.second.module.expired();
+      return alive;
+    }
+  }
+}
@@ -18,6 +18,8 @@
 // All the utilities required to generate scenes related to vulkan should be
 // found here.
 
+#include <algorithm>
+#include <cstdio>
 #include <numeric>
 #include <vulkan/vulkan.hpp>
 #include <vulkan/vulkan_core.h>
@@ -25,7 +27,15 @@
 #include "vulkan-core.h"
 
 static std::optional<vk::PresentModeKHR> PickPresentMode(
-  std::vector<vk::PresentModeKHR> const& present_modes) {
+  std::vector<vk::PresentModeKHR> const& present_modes,
+  std::optional<vk::PresentModeKHR> preferred_mode) {
+  if (preferred_mode) {
+    if (std::find(present_modes.begin(), present_modes.end(), *preferred_mode)
+        != present_modes.end())
+      return preferred_mode;
+    fprintf(stderr, "Warning: present mode %s is not supported.\n",
+            vk::to_string(*preferred_mode).c_str());
+  }
   vk::PresentModeKHR picked_mode = vk::PresentModeKHR::eFifo;
   for(const auto& present_mode : present_modes) {
     if(present_mode == vk::PresentModeKHR::eMailbox) {
@@ -83,7 +93,8 @@ namespace space {
       vk::PhysicalDevice const& physical_device, vk::UniqueDevice const& device,
       vk::SurfaceKHR const& surface, vk::Extent2D const& extent, vk::ImageUsageFlags usage,
       vk::UniqueSwapchainKHR const& old_swap_chain, uint32_t graphics_queue_family_index,
-      uint32_t present_queue_family_index) {
+      uint32_t present_queue_family_index,
+      std::optional<vk::PresentModeKHR> preferred_present_mode, uint32_t image_count) {
       vk::SurfaceFormatKHR surface_format = ::PickSurfaceFormat(
         physical_device.getSurfaceFormatsKHR(surface)).value();
       color_format = surface_format.format;
@@ -121,9 +132,13 @@ namespace space {
         ? vk::CompositeAlphaFlagBitsKHR::eInherit
         : vk::CompositeAlphaFlagBitsKHR::eOpaque;
       vk::PresentModeKHR present_mode = PickPresentMode(
-        physical_device.getSurfacePresentModesKHR(surface)).value();
+        physical_device.getSurfacePresentModesKHR(surface), preferred_present_mode).value();
+      // A max image count of 0 means there's no limit.
+      image_count = std::max(image_count, surface_capabilities.minImageCount);
+      if (surface_capabilities.maxImageCount > 0)
+        image_count = std::min(image_count, surface_capabilities.maxImageCount);
       vk::SwapchainCreateInfoKHR swapChainCreateInfo(
-        {}, surface, surface_capabilities.minImageCount,
+        {}, surface, image_count,
         color_format, surface_format.colorSpace, swap_chain_extent,
         1, usage, vk::SharingMode::eExclusive, 0, nullptr,
         pre_transform, composite_alpha, present_mode, true, *old_swap_chain);
@@ -168,13 +183,13 @@ namespace space {
     BufferData::BufferData(
       vk::PhysicalDevice const& physicalDevice, vk::UniqueDevice const& device,
       vk::DeviceSize size, vk::BufferUsageFlags usage,
-      vk::MemoryPropertyFlags propertyFlags)
+      vk::MemoryPropertyFlags propertyFlags, const char *tag)
       : m_size(size), m_usage(usage), m_propertyFlags(propertyFlags) {
       buffer = device->createBufferUnique(
         vk::BufferCreateInfo(vk::BufferCreateFlags(), size, usage));
       deviceMemory = AllocateMemory(
         device, physicalDevice.getMemoryProperties(),
-        device->getBufferMemoryRequirements(buffer.get()), propertyFlags);
+        device->getBufferMemoryRequirements(buffer.get()), propertyFlags, tag);
       device->bindBufferMemory(buffer.get(), deviceMemory.get(), 0);
     }
 
@@ -217,7 +232,9 @@ namespace space {
       assert(dataSize <= m_size);
 
       BufferData stagingBuffer(
-        physicalDevice, device, dataSize, vk::BufferUsageFlagBits::eTransferSrc);
+        physicalDevice, device, dataSize, vk::BufferUsageFlagBits::eTransferSrc,
+        vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
+        "staging");
 
       CopyToDevice(
         device, stagingBuffer.deviceMemory, data.data(),
@@ -237,16 +254,29 @@ namespace space {
       vk::Format format, vk::Extent2D const& extent, vk::ImageTiling tiling,
       vk::ImageUsageFlags usage, vk::ImageLayout initial_layout,
       vk::MemoryPropertyFlags memory_properties, vk::ImageAspectFlags aspect_mask,
-      vk::SampleCountFlagBits nsamples)
+      vk::SampleCountFlagBits nsamples, const char *tag)
       : format(format) {
       vk::ImageCreateInfo image_create_info(
         vk::ImageCreateFlags(), vk::ImageType::e2D, format, vk::Extent3D(extent, 1), 1, 1,
         nsamples, tiling, usage,
         vk::SharingMode::eExclusive, 0, nullptr, initial_layout);
       image = device->createImageUnique(image_create_info);
+      const vk::PhysicalDeviceMemoryProperties device_memory_properties =
+        physical_device.getMemoryProperties();
+      const vk::MemoryRequirements requirements = device->getImageMemoryRequirements(image.get());
+      if (memory_properties & vk::MemoryPropertyFlagBits::eLazilyAllocated) {
+        // Only offered by some devices, mostly tilers.
+        bool found = false;
+        for (uint32_t i = 0; i < device_memory_properties.memoryTypeCount; ++i) {
+          found |= (requirements.memoryTypeBits & (1u << i))
+            && (device_memory_properties.memoryTypes[i].propertyFlags & memory_properties)
+            == memory_properties;
+        }
+        if (!found) memory_properties &= ~vk::MemoryPropertyFlags(
+            vk::MemoryPropertyFlagBits::eLazilyAllocated);
+      }
       device_memory = AllocateMemory(
-        device, physical_device.getMemoryProperties(),
-        device->getImageMemoryRequirements(image.get()), memory_properties);
+        device, device_memory_properties, requirements, memory_properties, tag);
       device->bindImageMemory(image.get(), device_memory.get(), 0);
       vk::ComponentMapping component_mapping(
         vk::ComponentSwizzle::eR, vk::ComponentSwizzle::eG, vk::ComponentSwizzle::eB,
@@ -257,17 +287,6 @@ namespace space {
       image_view = device->createImageViewUnique(image_view_create_info);
     }
 
-    vk::UniqueDeviceMemory AllocateMemory(
-      vk::UniqueDevice const& device,
-      vk::PhysicalDeviceMemoryProperties const& memory_properties,
-      vk::MemoryRequirements const& memory_requirements,
-      vk::MemoryPropertyFlags memory_property_flags) {
-      uint32_t memory_type_index = FindMemoryType(
-        memory_properties, memory_requirements.memoryTypeBits, memory_property_flags);
-      return device->allocateMemoryUnique(
-        vk::MemoryAllocateInfo(memory_requirements.size, memory_type_index));
-    }
-
     uint32_t FindMemoryType(
       vk::PhysicalDeviceMemoryProperties const& memory_properties,
       uint32_t type_bits, vk::MemoryPropertyFlags requirements_mask) {
@@ -340,16 +359,31 @@ namespace space {
       std::vector<vk::UniqueImageView> const& imageViews,
       vk::UniqueImageView const& depthImageView,
       vk::UniqueImageView const& colorImageView, vk::Extent2D const& extent) {
+      std::vector<vk::ImageView> views;
+      views.reserve(imageViews.size());
+      for (auto const& view : imageViews)
+        views.push_back(*view);
+      return CreateFramebuffers(device, renderPass, views, depthImageView, colorImageView, extent);
+    }
+
+    std::vector<vk::UniqueFramebuffer> CreateFramebuffers(
+      vk::UniqueDevice &device, vk::UniqueRenderPass &renderPass,
+      std::vector<vk::ImageView> const& imageViews,
+      vk::UniqueImageView const& depthImageView,
+      vk::UniqueImageView const& colorImageView, vk::Extent2D const& extent) {
+      // Same order as the render pass attachments.
+      const bool multisampled = static_cast<bool>(colorImageView);
+      const uint32_t target = multisampled ? 1 : 0;
       vk::ImageView attachments[3];
       attachments[0] = *colorImageView;
-      attachments[2] = *depthImageView;
+      attachments[target + 1] = *depthImageView;
 
       std::vector<vk::UniqueFramebuffer> framebuffers;
       framebuffers.reserve(imageViews.size());
       for (auto const& view : imageViews) {
-        attachments[1] = *view;
+        attachments[target] = view;
         vk::FramebufferCreateInfo framebufferCreateInfo(
-          vk::FramebufferCreateFlags(), *renderPass, 3,
+          vk::FramebufferCreateFlags(), *renderPass, target + 2,
           attachments, extent.width, extent.height, 1);
         framebuffers.push_back(device->createFramebufferUnique(framebufferCreateInfo));
       }
@@ -399,23 +433,27 @@ namespace space {
       vk::SampleCountFlagBits nsamples) {
       std::vector<vk::AttachmentDescription> attachmentDescriptions;
       assert(colorFormat != vk::Format::eUndefined);
-      attachmentDescriptions.push_back(
-        vk::AttachmentDescription(
-          vk::AttachmentDescriptionFlags(),
-          colorFormat, nsamples,
-          loadOp,
-          vk::AttachmentStoreOp::eDontCare,
-          vk::AttachmentLoadOp::eDontCare,
-          vk::AttachmentStoreOp::eDontCare,
-          vk::ImageLayout::eUndefined,
-          vk::ImageLayout::eColorAttachmentOptimal));
+      const bool multisampled = nsamples != vk::SampleCountFlagBits::e1;
+      if (multisampled) {
+        attachmentDescriptions.push_back(
+          vk::AttachmentDescription(
+            vk::AttachmentDescriptionFlags(),
+            colorFormat, nsamples,
+            loadOp,
+            vk::AttachmentStoreOp::eDontCare,
+            vk::AttachmentLoadOp::eDontCare,
+            vk::AttachmentStoreOp::eDontCare,
+            vk::ImageLayout::eUndefined,
+            vk::ImageLayout::eColorAttachmentOptimal));
+      }
 
-      // Resolve attachment
+      // Resolve attachment, or the only color attachment
+      // when not multisampling.
       attachmentDescriptions.push_back(
         vk::AttachmentDescription(
           vk::AttachmentDescriptionFlags(),
           colorFormat, vk::SampleCountFlagBits::e1,
-          vk::AttachmentLoadOp::eDontCare,
+          multisampled ? vk::AttachmentLoadOp::eDontCare : loadOp,
           vk::AttachmentStoreOp::eStore,
           vk::AttachmentLoadOp::eDontCare,
           vk::AttachmentStoreOp::eDontCare,
@@ -434,17 +472,18 @@ namespace space {
             vk::ImageLayout::eDepthStencilAttachmentOptimal));
       }
 
+      const uint32_t target = multisampled ? 1 : 0;
       vk::AttachmentReference colorAttachment(
         0, vk::ImageLayout::eColorAttachmentOptimal);
       vk::AttachmentReference colorResolveAttachment(
-        1, vk::ImageLayout::eColorAttachmentOptimal);
+        target, vk::ImageLayout::eColorAttachmentOptimal);
       vk::AttachmentReference depthAttachment(
-        2, vk::ImageLayout::eDepthStencilAttachmentOptimal);
+        target + 1, vk::ImageLayout::eDepthStencilAttachmentOptimal);
 
       vk::SubpassDescription subpassDescription(
         vk::SubpassDescriptionFlags(), vk::PipelineBindPoint::eGraphics,
         0, nullptr,
-        1, &colorAttachment, &colorResolveAttachment,
+        1, &colorAttachment, multisampled ? &colorResolveAttachment : nullptr,
         (depthFormat != vk::Format::eUndefined) ? &depthAttachment : nullptr);
 
       return device->createRenderPassUnique(